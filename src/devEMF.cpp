@@ -42,6 +42,9 @@
 #include "emf.h"  //defines EMF data structures
 #include "emf+.h" //defines EMF+ data structures
 #include "fontmetrics.h" //platform-specific font metric code
+#include "geom.h" //geometry processing (simplification, curve fitting)
+#include "state.h" //elides redundant EMF/EMF+ state records
+#include "page.h" //buffered page & its optimization passes
 
 using namespace std;
 
@@ -49,12 +52,14 @@ using namespace std;
 class CDevEMF {
 public:
     CDevEMF(const char *defaultFontFamily, int coordDPI, bool customLty,
-            bool emfPlus, bool emfpFont, bool emfpRaster, bool emfpEmbed) :
+            bool emfPlus, bool emfpFont, bool emfpRaster, bool emfpEmbed,
+            double simplify, double curveFit, bool decimate,
+            EMFPLUS::ESlotPolicy cachePolicy, double rasterMaxDPI,
+            bool bufferPage, bool stats) :
         m_debug(false) {
         m_DefaultFontFamily = defaultFontFamily;
         m_PageNum = 0;
         m_NumRecords = 0;
-        m_CurrHadj = m_CurrPolyFill = -100;
         m_CurrClip[0] = m_CurrClip[1] = m_CurrClip[2] = m_CurrClip[3] = -1;
         m_CoordDPI = coordDPI;
         //feature options
@@ -64,27 +69,47 @@ public:
         m_UseEMFPlusFont = emfpFont;
         m_UseEMFPlusRaster = emfpRaster;
         m_UseEMFPlusTextToPath = emfpEmbed;
+        m_SimplifyTol = simplify;
+        m_CurveFitTol = curveFit;
+        m_Decimate = decimate;
+        m_ObjectTable.SetPolicy(cachePolicy);
+        m_RasterMaxDPI = rasterMaxDPI;
+        m_Buffering = bufferPage;
+        m_PlanSlots = bufferPage  &&  emfPlus  &&
+            cachePolicy == EMFPLUS::eSlotPolicyPlanned;
+        m_Planning = false;
+        m_ShapesCleared = false;
+        m_Stats = stats;
+        memset(&m_CullStats, 0, sizeof(m_CullStats));
+        memset(&m_PageStats, 0, sizeof(m_PageStats));
+        memset(&m_PlanStats, 0, sizeof(m_PlanStats));
     }
 
     // Member-function R callbacks (see below class definition for
-    // extern "C" versions
+    // extern "C" versions).  Drawing callbacks are also used to draw a
+    // buffered page, with 'replay' set so that they draw immediately
     bool Open(const char* filename, int width, int height);
     void Close(void);
     void NewPage(const pGEcontext gc);
     void MetricInfo(int c, const pGEcontext gc, double* ascent,
                     double* descent, double* width);
     double StrWidth(const char *str, const pGEcontext gc);
-    void Clip(double x0, double x1, double y0, double y1);
-    void Circle(double x, double y, double r, const pGEcontext gc);
+    void Clip(double x0, double x1, double y0, double y1,
+              bool replay = false);
+    void Circle(double x, double y, double r, const pGEcontext gc,
+                bool replay = false);
     void Line(double x1, double y1, double x2, double y2, const pGEcontext gc);
-    void Polyline(int n, double *x, double *y, const pGEcontext gc);
+    void Polyline(int n, const double *x, const double *y,
+                  const pGEcontext gc, bool replay = false);
     void TextUTF8(double x, double y, const char *str, double rot,
-                  double hadj, const pGEcontext gc);
-
-    void Rect(double x0, double y0, double x1, double y1, const pGEcontext gc);
-    void Polygon(int n, double *x, double *y, const pGEcontext gc);
-    void Path(double *x, double *y, int nPoly, int *nPts, bool winding,
-              const pGEcontext gc);
+                  double hadj, const pGEcontext gc, bool replay = false);
+
+    void Rect(double x0, double y0, double x1, double y1, const pGEcontext gc,
+              bool replay = false);
+    void Polygon(int n, const double *x, const double *y, const pGEcontext gc,
+                 bool replay = false);
+    void Path(const double *x, const double *y, int nPoly, const int *nPts,
+              bool winding, const pGEcontext gc, bool replay = false);
     void Raster(unsigned int* data, int w, int h, double x, double y,
                 double width, double height, double rot,
                 Rboolean interpolate);
@@ -96,6 +121,9 @@ public:
     }
 
 private:
+    enum EBatchKind {eBatchNone, eBatchCircles, eBatchPolygons, eBatchRects,
+                     eBatchLines};
+
     static string iConvUTF8toUTF16LE(const string& s) {
         void *cd = Riconv_open("UTF-16LE", "UTF-8");
         if (cd == (void*)(-1)) {
@@ -118,6 +146,8 @@ private:
         Riconv_close(cd);
         return ret;
     }
+    //in-place flip for local copies only (point arrays from R are
+    //flipped by the records themselves so R's buffers remain untouched)
     void x_TransformY(double* y, int n) {
         for (int i = 0; i < n;  ++i, ++y) *y = m_Height - *y;
     }
@@ -143,38 +173,38 @@ private:
             return -1;
         }
         if (!R_TRANSPARENT(gc->fill)) {
-            return m_ObjectTable.GetBrush(new EMFPLUS::SBrush(gc->fill),m_File);
+            EMFPLUS::SBrush b(gc->fill);
+            return m_ObjectTable.GetBrush(b, m_File);
         }
 #if R_GE_version >= 13
         switch (R_GE_patternType(gc->patternFill)) {
         case R_GE_linearGradientPattern: {
-            EMFPLUS::SBrush* b =
-                new EMFPLUS::SBrush(EMFPLUS::eBrushTypeLinearGradient);
-            b->gradCoords.x = R_GE_linearGradientX1(gc->patternFill);
-            b->gradCoords.y = R_GE_linearGradientY1(gc->patternFill);
-            x_TransformY(&b->gradCoords.y, 1);
-            b->gradCoords.w = R_GE_linearGradientX2(gc->patternFill) -
-                b->gradCoords.x;
+            EMFPLUS::SBrush b(EMFPLUS::eBrushTypeLinearGradient);
+            b.gradCoords.x = R_GE_linearGradientX1(gc->patternFill);
+            b.gradCoords.y = R_GE_linearGradientY1(gc->patternFill);
+            x_TransformY(&b.gradCoords.y, 1);
+            b.gradCoords.w = R_GE_linearGradientX2(gc->patternFill) -
+                b.gradCoords.x;
             double y2 = R_GE_linearGradientY2(gc->patternFill);
             x_TransformY(&y2, 1);
-            b->gradCoords.h =  y2 - b->gradCoords.y;
+            b.gradCoords.h =  y2 - b.gradCoords.y;
             switch (R_GE_linearGradientExtend(gc->patternFill)) {
                 //not sure if pad/none are correctly mapped..
             case R_GE_patternExtendPad:
-                b->wrapMode = EMFPLUS::eWrapModeClamp; break;
+                b.wrapMode = EMFPLUS::eWrapModeClamp; break;
             case R_GE_patternExtendRepeat:
-                b->wrapMode = EMFPLUS::eWrapModeTile; break;
+                b.wrapMode = EMFPLUS::eWrapModeTile; break;
             case R_GE_patternExtendReflect:
-                b->wrapMode = EMFPLUS::eWrapModeTileFlipXY; break;
+                b.wrapMode = EMFPLUS::eWrapModeTileFlipXY; break;
             case R_GE_patternExtendNone:
-                b->wrapMode = EMFPLUS::eWrapModeClamp; break;
+                b.wrapMode = EMFPLUS::eWrapModeClamp; break;
             }
             int n = R_GE_linearGradientNumStops(gc->patternFill);
-            b->blendVector.resize(n);
+            b.blendVector.resize(n);
             for (int i = 0;  i < n;  ++i) {
-                b->blendVector[i].pos =
+                b.blendVector[i].pos =
                     R_GE_linearGradientStop(gc->patternFill, i);
-                b->blendVector[i].col =
+                b.blendVector[i].col =
                     R_GE_linearGradientColour(gc->patternFill, i);
             }
             return m_ObjectTable.GetBrush(b, m_File);
@@ -186,6 +216,48 @@ private:
         return -1;
     }
 
+    //EMF+ path fill: solid colours are given inline (so need no brush
+    //object in the table); only pattern fills use a brush object
+    void x_FillPath(int pathId, const pGEcontext gc) {
+        if (!R_TRANSPARENT(gc->fill)) {
+            EMFPLUS::SFillPath fill(pathId, R_RED(gc->fill),
+                                    R_GREEN(gc->fill), R_BLUE(gc->fill),
+                                    R_ALPHA(gc->fill));
+            fill.Write(m_File);
+            return;
+        }
+        int brushId = x_GetBrush(gc);
+        if (brushId >= 0) {
+            EMFPLUS::SFillPath fill(pathId, brushId);
+            fill.Write(m_File);
+        }
+    }
+
+    //returns true if a polygon of the same shape (ignoring position)
+    //has been drawn before; otherwise remembers the shape
+    bool x_IsRepeatedShape(int n, const double *x, const double *y) {
+        m_ShapeKey.resize(2*n);
+        for (int i = 0;  i < n;  ++i) {
+            m_ShapeKey[2*i] = (float) (x[i] - x[0]);
+            m_ShapeKey[2*i+1] = (float) (y[i] - y[0]);
+        }
+        if (m_SeenShapes.find(m_ShapeKey) != m_SeenShapes.end()) {
+            return true;
+        }
+        if (m_SeenShapes.size() >= kMaxSeenShapes) {
+            if (m_Planning  &&  !m_ShapesCleared) { //(put back after)
+                m_ShapesCleared = true;
+                m_ShapesBefore.swap(m_SeenShapes);
+            }
+            m_SeenShapes.clear(); //bound memory (only loses opportunities)
+        }
+        m_SeenShapes.insert(m_ShapeKey);
+        if (m_Planning  &&  !m_ShapesCleared) {
+            m_NewShapes.push_back(m_ShapeKey);
+        }
+        return false;
+    }
+
     class CFontInfoIndex : public map<SSysFontInfo::SFontSpec, SSysFontInfo*> {
     public:
         ~CFontInfoIndex(void) {
@@ -226,21 +298,476 @@ private:
                                      iConvUTF8toUTF16LE(info->m_Spec.m_Family),
                                      rot, m_File);
     }
+    //bounds of a rectangle rotated (in degrees) about its lower left
+    //corner (x,y)
+    static GEOM::SBBox x_RotatedRectBBox(double x, double y, double w,
+                                         double h, double rot) {
+        double c = cos(rot*M_PI/180), s = sin(rot*M_PI/180);
+        double cx[4] = {x, x + c*w, x - s*h, x + c*w - s*h};
+        double cy[4] = {y, y + s*w, y + c*h, y + s*w + c*h};
+        GEOM::SBBox bbox;
+        bbox.Extend(4, cx, cy);
+        return bbox;
+    }
+    //current clip region within device bounds (in R coordinates)
+    GEOM::SBBox x_VisibleRegion(void) const {
+        GEOM::SBBox visible(0, 0, m_Width, m_Height);
+        if (m_CurrClip[0] != -1  &&  m_CurrClip[1] != -1  &&
+            m_CurrClip[2] != -1  &&  m_CurrClip[3] != -1) {
+            GEOM::SBBox clip(m_CurrClip[0], m_CurrClip[1],
+                             m_CurrClip[2], m_CurrClip[3]);
+            visible.x0 = max(visible.x0, clip.x0);
+            visible.y0 = max(visible.y0, clip.y0);
+            visible.x1 = min(visible.x1, clip.x1);
+            visible.y1 = min(visible.y1, clip.y1);
+        }
+        return visible;
+    }
+    bool x_HasStroke(const pGEcontext gc) const {
+        return !R_TRANSPARENT(gc->col)  &&  gc->lty != LTY_BLANK;
+    }
+    bool x_HasFill(const pGEcontext gc) const {
+        bool hasFill = !R_TRANSPARENT(gc->fill);
+#if R_GE_version >= 13
+        hasFill = hasFill  ||  (gc->patternFill != R_NilValue);
+#endif
+        return hasFill;
+    }
+    //grows bounds of a primitive (in R coordinates) to cover all ink
+    //drawn, allowing for line width
+    void x_GrowToInk(GEOM::SBBox &bbox, const pGEcontext gc) {
+        if (x_HasStroke(gc)) { //allow for line width (and mitre spikes)
+            double halfWidth = gc->lwd * Inches2Dev(1)/96. / 2;
+            if (gc->ljoin == GE_MITRE_JOIN  &&  gc->lmitre > 1) {
+                halfWidth *= gc->lmitre;
+            }
+            bbox.Grow(halfWidth);
+        }
+        bbox.Grow(1); //allow for rounding/anti-aliasing
+    }
+    //generous bounds (in R coordinates) of text with baseline starting
+    //at (x,y): from half an em below the baseline to an em above, plus
+    //a margin in case the viewer substitutes a wider font; without font
+    //metrics the width is unknown, so the ink is taken to be the whole
+    //page (never culled, and overlapping everything)
+    GEOM::SBBox x_TextInk(double x, double y, const char *str, double rot,
+                          double hadj, const pGEcontext gc,
+                          SSysFontInfo *info) {
+        if (!info) {
+            return GEOM::SBBox(0, 0, m_Width, m_Height);
+        }
+        double em = x_EffPointsize(gc)/72. * Inches2Dev(1);
+        double width = info->GetStrWidth(str);
+        double c = cos(rot*M_PI/180), s = sin(rot*M_PI/180);
+        double x0 = x - hadj*width*c, y0 = y - hadj*width*s;
+        GEOM::SBBox ink = x_RotatedRectBBox(x0 + em/2*s, y0 - em/2*c,
+                                            width, 1.5*em, rot);
+        ink.Grow((width + em)/4);
+        return ink;
+    }
+    //returns true (and counts) if a primitive with the given bounds (in
+    //R coordinates, before allowing for line width) cannot be seen
+    //because it is invisible, entirely outside the current clip
+    //region, or (if unstroked) has zero area; otherwise bbox is grown
+    //to cover all ink drawn by the primitive
+    bool x_Cull(GEOM::SBBox &bbox, const pGEcontext gc, bool fillable) {
+        ++m_CullStats.nPrimitives;
+        bool stroked = x_HasStroke(gc);
+        bool filled = fillable  &&  x_HasFill(gc);
+        if (!stroked  &&  !filled) {
+            ++m_CullStats.nInvisible;
+            return true;
+        }
+        if (!stroked  &&  bbox.HasZeroArea()) {
+            ++m_CullStats.nDegenerate;
+            return true;
+        }
+        x_GrowToInk(bbox, gc);
+        if (!bbox.Intersects(x_VisibleRegion())) {
+            ++m_CullStats.nOutside;
+            return true;
+        }
+        return false;
+    }
+    //a primitive whose shape (bounds before line width) and outline
+    //together fit within one device unit is drawn as a filled square
+    //of that size, in its outline colour if stroked (else its fill
+    //colour); returns false, drawing nothing, if it is any larger
+    bool x_Collapse(const GEOM::SBBox &shape, const GEOM::SBBox &ink,
+                    const pGEcontext gc) {
+        bool stroked = x_HasStroke(gc);
+        double lineWidth = stroked ? gc->lwd * Inches2Dev(1)/96. : 0;
+        if (shape.x1 - shape.x0 + lineWidth > 1  ||
+            shape.y1 - shape.y0 + lineWidth > 1) {
+            return false;
+        }
+        R_GE_gcontext dot = *gc;
+#if R_GE_version >= 13
+        if (!stroked  &&  gc->patternFill != R_NilValue) {
+            return false; //(colour unknown)
+        }
+        dot.patternFill = R_NilValue;
+#endif
+        if (stroked) {
+            dot.fill = gc->col;
+        }
+        dot.col = R_TRANWHITE;
+        ++m_CullStats.nCollapsed;
+        double cx = (shape.x0 + shape.x1)/2, cy = (shape.y0 + shape.y1)/2;
+        double x[2], y[2]; //opposite corners
+        x[0] = cx - 0.5; x[1] = cx + 0.5;
+        y[0] = cy - 0.5; y[1] = cy + 0.5;
+        x_ReleaseHeldText(ink);
+        if (x_AddToBatch(eBatchRects, ink, 2, &dot)) {
+            m_Batch.Add(2, x, y, 0);
+            return true;
+        }
+        x_DrawRects(1, x, y, &dot);
+        return true;
+    }
+    //with decimation enabled, returns true if an opaque marker (circle
+    //of radius r, or small polygon) exactly repeats one drawn earlier
+    //that nothing has since drawn over, so drawing it again would not
+    //change the image; otherwise records the marker's ink as drawn
+    bool x_IsHiddenMarker(const GEOM::SBBox &ink, const pGEcontext gc,
+                          int n, const double *x, const double *y, double r){
+        if (!m_Decimator.IsActive()) {
+            return false;
+        }
+        bool opaque = (R_OPAQUE(gc->col)  ||  R_TRANSPARENT(gc->col))  &&
+            (R_OPAQUE(gc->fill)  ||  R_TRANSPARENT(gc->fill));
+#if R_GE_version >= 13
+        opaque = opaque  &&  gc->patternFill == R_NilValue;
+#endif
+        if (!opaque) {
+            m_Decimator.Cover(ink);
+            return false;
+        }
+        GEOM::CMarkerDecimator::TKey &key = m_MarkerKey;
+        key.clear();
+        key.push_back(n);
+        key.push_back(r);
+        key.push_back(gc->col);
+        key.push_back(gc->fill);
+        key.push_back(gc->lwd);
+        key.push_back(gc->lty);
+        key.push_back(gc->lend);
+        key.push_back(gc->ljoin);
+        key.push_back(gc->lmitre);
+        key.insert(key.end(), m_CurrClip, m_CurrClip+4);
+        key.insert(key.end(), x, x+n);
+        key.insert(key.end(), y, y+n);
+        if (m_Decimator.IsRepeat(key, ink)) {
+            ++m_CullStats.nRepeated;
+            return true;
+        }
+        return false;
+    }
+    //record drawing (other than a marker) for decimation
+    void x_Cover(const GEOM::SBBox &ink) {
+        if (m_Decimator.IsActive()) {
+            m_Decimator.Cover(ink);
+        }
+    }
+    //EMF text drawn among EMF+ records is held back (see EMF::ofstream)
+    //so that runs of labels share one switch to EMF; anything drawn
+    //over held text must come after it, so first releases it (as does
+    //any EMF record that is not held)
+    void x_ReleaseHeldText(const GEOM::SBBox &ink) {
+        for (unsigned int i = 0;  i < m_HeldTextInk.size();  ++i) {
+            if (m_HeldTextInk[i].Intersects(ink)) {
+                x_ReleaseHeldText();
+                return;
+            }
+        }
+    }
+    void x_ReleaseHeldText(void) {
+        if (!m_File.heldEMF.empty()) {
+            EMF::SwitchToEMF(m_File);
+        }
+        m_HeldTextInk.clear();
+    }
+
+    //returns true if a shape or line (with ink bounds and number of
+    //path points given) can join the pending batch, starting a new
+    //batch (after drawing the pending one) if necessary
+    bool x_AddToBatch(EBatchKind kind, const GEOM::SBBox &ink,
+                      unsigned int nPts, const pGEcontext gc) {
+        bool batchable = (m_UseEMFPlus  ||  kind == eBatchLines)  &&
+            nPts <= SBatch::kMaxPathPts;
+#if R_GE_version >= 13
+        batchable = batchable  &&  gc->patternFill == R_NilValue;
+#endif
+        if (!batchable) {
+            x_FlushBatch();
+            return false;
+        }
+        if (!m_Batch.Accepts(kind, ink, nPts, gc)) {
+            x_FlushBatch();
+            //overlapping lines are fine unless partially transparent
+            //(EMF has no transparency)
+            m_Batch.Start(kind, gc, kind != eBatchLines  ||
+                          (m_UseEMFPlus  &&  !R_OPAQUE(gc->col)));
+        }
+        m_Batch.m_Ink.push_back(ink);
+        m_Batch.m_NPathPts += nPts;
+        return true;
+    }
+    //draw pending batch as a single filled & stroked EMF+ path
+    void x_FlushBatch(void) {
+        if (m_Batch.m_Kind == eBatchNone) {
+            return;
+        }
+        SBatch &b = m_Batch;
+        pGEcontext gc = &b.m_GC;
+        if (b.m_Kind == eBatchRects) { //native records; no path needed
+            x_DrawRects(b.m_NPts.size(), &b.m_X[0], &b.m_Y[0], gc);
+            b.Clear();
+            return;
+        }
+        if (b.m_NPts.size() == 1) { //nothing gained from a path
+            if (b.m_Kind == eBatchCircles) {
+                x_DrawCircle(b.m_X[0], b.m_Y[0], b.m_R[0], gc);
+            } else if (b.m_Kind == eBatchPolygons) {
+                x_DrawPolygon(b.m_NPts[0], &b.m_X[0], &b.m_Y[0], gc);
+            } else {
+                x_DrawPolyline(b.m_NPts[0], &b.m_X[0], &b.m_Y[0], gc);
+            }
+            b.Clear();
+            return;
+        }
+        m_State.Apply(m_UseEMFPlus, m_File);
+        if (b.m_Kind == eBatchLines  &&  !m_UseEMFPlus) {
+            x_GetPen(gc);
+            EMF::SPolyPolyline lines(b.m_NPts.size(), &b.m_NPts[0],
+                                     &b.m_X[0], &b.m_Y[0], m_Height);
+            lines.Write(m_File);
+            b.Clear();
+            return;
+        }
+        EMFPLUS::SPath &path = m_Path;
+        path.Clear();
+        path.m_OpenFigures = (b.m_Kind == eBatchLines);
+        for (unsigned int i = 0, start = 0;  i < b.m_NPts.size();
+             start += b.m_NPts[i++]) {
+            double x = b.m_X[start], y = m_Height - b.m_Y[start];
+            if (b.m_Kind == eBatchCircles) {
+                double r = b.m_R[i], k = 0.5522847498 * r; //Bezier arc
+                path.StartNewPoly(x + r, y);
+                path.AddCubicBezierTo(x + r, y + k, x + k, y + r, x, y + r);
+                path.AddCubicBezierTo(x - k, y + r, x - r, y + k, x - r, y);
+                path.AddCubicBezierTo(x - r, y - k, x - k, y - r, x, y - r);
+                path.AddCubicBezierTo(x + k, y - r, x + r, y - k, x + r, y);
+            } else {
+                path.StartNewPoly(x, y);
+                for (int j = 1;  j < b.m_NPts[i];  ++j) {
+                    path.AddLineTo(b.m_X[start+j], m_Height-b.m_Y[start+j]);
+                }
+            }
+        }
+        int pathId = m_ObjectTable.GetPath(path, m_File);
+        if (b.m_Kind == eBatchLines) {
+            EMFPLUS::SDrawPath drawPath(pathId, x_GetPen(gc));
+            drawPath.Write(m_File);
+            b.Clear();
+            return;
+        }
+        //same order as individual shapes (circles: outline first)
+        if (b.m_Kind == eBatchCircles  &&  !R_TRANSPARENT(gc->col)) {
+            EMFPLUS::SDrawPath drawPath(pathId, x_GetPen(gc));
+            drawPath.Write(m_File);
+        }
+        x_FillPath(pathId, gc);
+        if (b.m_Kind == eBatchPolygons  &&  !R_TRANSPARENT(gc->col)) {
+            EMFPLUS::SDrawPath drawPath(pathId, x_GetPen(gc));
+            drawPath.Write(m_File);
+        }
+        b.Clear();
+    }
+    //with a buffered page, returns true if a primitive should be
+    //recorded (to be drawn with the rest of the page) rather than drawn
+    //now; otherwise anything recorded so far is drawn first
+    bool x_Defer(const pGEcontext gc) {
+        if (!m_Buffering) {
+            return false;
+        }
+#if R_GE_version >= 13
+        if (gc->patternFill != R_NilValue) { //(may not outlive this call)
+            x_DrawPage();
+            return false;
+        }
+#endif
+        if (m_Page.IsFull()) {
+            x_DrawPage();
+        }
+        return true;
+    }
+    //optimizes the primitives recorded for the page and draws them
+    void x_DrawPage(void) {
+        if (m_Page.IsEmpty()) {
+            return;
+        }
+        unsigned int nOps = m_Page.Ops().size();
+        unsigned int nClips = PAGE::ElideClips(m_Page);
+        unsigned int nRepeats = m_Decimate ? PAGE::Dedup(m_Page) : 0;
+        unsigned int nCulled = PAGE::Cull(m_Page);
+        //(EMF+ circles are smaller drawn apart than as one path)
+        unsigned int nMoved = PAGE::Reorder
+            (m_Page, (1 << PAGE::eOpLine) | (1 << PAGE::eOpRect) |
+             (1 << PAGE::eOpPolygon) |
+             (m_UseEMFPlus ? 0 : 1 << PAGE::eOpCircle));
+        if (m_debug) Rprintf("page: %u operations (%u clips elided, %u "
+                             "repeats, %u culled, %u moved)\n", nOps, nClips,
+                             nRepeats, nCulled, nMoved);
+        m_PageStats.nOps += nOps;
+        m_PageStats.nClips += nClips;
+        m_PageStats.nRepeats += nRepeats;
+        m_PageStats.nCulled += nCulled;
+        m_PageStats.nMoved += nMoved;
+        //(moved aside before drawing, which can raise an R error, so
+        //that the page cannot be left to be drawn again)
+        m_Replay.Clear();
+        m_Replay.Swap(m_Page);
+        if (m_PlanSlots) {
+            x_PlanSlots();
+            double written = m_ObjectTable.GetStats().bytesWritten;
+            x_ReplayPage();
+            x_FlushBatch(); //(as in the dry run)
+            m_PlanStats.bytesWritten +=
+                m_ObjectTable.GetStats().bytesWritten - written;
+        } else {
+            x_ReplayPage();
+        }
+        m_Replay.Clear();
+    }
+
+    void x_ReplayPage(void) {
+        PAGE::CPage &page = m_Replay;
+        const std::vector<PAGE::SOp> &ops = page.Ops();
+        for (unsigned int i = 0;  i < ops.size();  ++i) {
+            const PAGE::SOp &op = ops[i];
+            if (op.kind == PAGE::eOpClip) {
+                Clip(op.p[0], op.p[1], op.p[2], op.p[3], true);
+                continue;
+            }
+            const double *x = page.X(op), *y = page.Y(op);
+            pGEcontext gc = page.Style(op);
+            switch (op.kind) {
+            case PAGE::eOpCircle: Circle(x[0], y[0], op.p[0], gc, true); break;
+            case PAGE::eOpLine: Polyline(op.n, x, y, gc, true); break;
+            case PAGE::eOpRect: Rect(x[0], y[0], x[1], y[1], gc, true); break;
+            case PAGE::eOpPolygon: Polygon(op.n, x, y, gc, true); break;
+            case PAGE::eOpPath:
+                Path(x, y, op.nAux, page.NPts(op), op.p[0] != 0, gc, true);
+                break;
+            case PAGE::eOpText:
+                TextUTF8(x[0], y[0], page.Text(op), op.p[0], op.p[1], gc,
+                         true);
+                break;
+            default: break;
+            }
+        }
+    }
+
+    //draws the page without output, only recording which EMF+ objects
+    //it uses, then puts back everything drawing changed; the object
+    //table can then look ahead when the page is drawn for real
+    void x_PlanSlots(void) {
+        STATE::CTracker state = m_State;
+        double currClip[4];
+        memcpy(currClip, m_CurrClip, sizeof(currClip));
+        EMF::CObjectTable objectTableEMF = m_ObjectTableEMF;
+        SBatch batch = m_Batch;
+        std::vector<GEOM::SBBox> heldTextInk = m_HeldTextInk;
+        SCullStats cullStats = m_CullStats;
+        m_Trace.Clear();
+        m_Decimator.Checkpoint(); //(journals rather than copies)
+        m_ShapesCleared = false;
+        {
+            EMF::CDryRun dryRun(m_File);
+            m_Planning = true;
+            m_ObjectTable.Trace(&m_Trace);
+            x_ReplayPage();
+            x_FlushBatch();
+            m_ObjectTable.Trace(NULL);
+            m_Planning = false;
+        }
+        m_State = state;
+        memcpy(m_CurrClip, currClip, sizeof(currClip));
+        m_ObjectTableEMF = objectTableEMF;
+        m_Batch = batch;
+        m_Decimator.Rollback();
+        m_HeldTextInk.swap(heldTextInk);
+        if (m_ShapesCleared) {
+            m_SeenShapes.swap(m_ShapesBefore);
+            m_ShapesBefore.clear();
+        }
+        for (size_t i = 0;  i < m_NewShapes.size();  ++i) {
+            m_SeenShapes.erase(m_NewShapes[i]);
+        }
+        m_NewShapes.clear();
+        m_CullStats = cullStats;
+
+        m_PlanStats.bytesLRU +=
+            m_ObjectTable.Simulate(m_Trace, EMFPLUS::eSlotPolicyLRU);
+        m_ObjectTable.Plan(m_Trace);
+        if (m_debug) Rprintf("planned %u EMF+ object uses\n",
+                             (unsigned int) m_Trace.keys.size());
+    }
+
+    void x_DrawCircle(double x, double y, double r, const pGEcontext gc);
+    void x_DrawPolygon(int n, const double *x, const double *y,
+                       const pGEcontext gc);
+    void x_DrawPolyline(int n, const double *x, const double *y,
+                        const pGEcontext gc);
+    void x_DrawRects(int n, const double *x, const double *y,
+                     const pGEcontext gc);
+
+    //replace a (dense) polyline with a stroked EMF+ path of cubic
+    //Bezier curves; returns false if that would not be more compact
+    bool x_DrawFittedCurves(int n, const double *x, const double *y,
+                            const pGEcontext gc) {
+        unsigned int nOut = m_CurveFitter.Fit(n, x, y, m_CurveFitTol);
+        //path object costs 9 bytes/point + header; lines 8 bytes/point
+        if (nOut < 4  ||  9*nOut + 24 >= 8*(unsigned int)n) {
+            return false;
+        }
+        x_FlushBatch();
+        const double *cx = m_CurveFitter.X(), *cy = m_CurveFitter.Y();
+        EMFPLUS::SPath &path = m_Path;
+        path.Clear();
+        path.m_OpenFigures = true;
+        path.StartNewPoly(cx[0], m_Height - cy[0]);
+        for (unsigned int i = 1;  i + 2 < nOut;  i += 3) {
+            path.AddCubicBezierTo(cx[i], m_Height - cy[i],
+                                   cx[i+1], m_Height - cy[i+1],
+                                   cx[i+2], m_Height - cy[i+2]);
+        }
+        int pathId = m_ObjectTable.GetPath(path, m_File);
+        m_State.Apply(true, m_File);
+        EMFPLUS::SDrawPath drawPath(pathId, x_GetPen(gc));
+        drawPath.Write(m_File);
+        return true;
+    }
+
     void x_SetEMFTextColor(int col) {
-        EMF::S_SETTEXTCOLOR emr;
-        emr.color.Set(R_RED(col), R_GREEN(col), R_BLUE(col));
-        if (R_ALPHA(col) > 0  &&  R_ALPHA(col) < 255) {
+        x_WarnEMFTextColor(col);
+        m_State.SetTextColor(col, m_File);
+    }
+    //warns (once per change of text colour) if col cannot be shown
+    void x_WarnEMFTextColor(int col) {
+        if (!m_State.IsTextColor(col)  &&  !m_Planning  &&
+            R_ALPHA(col) > 0  &&  R_ALPHA(col) < 255) {
             Rf_warning("partial transparency is not supported for EMF "
                        "fonts (consider enabling EMF+, although be aware "
                        "LibreOffice EMF+ font support is incomplete)");
         }
-        emr.Write(m_File);
-        m_CurrTextCol = col;
     }
 
 
 private:
     bool m_debug;
+    bool m_Stats; //(report counts on close)
     EMF::ofstream m_File;
     int m_NumRecords;
     int m_PageNum;
@@ -252,19 +779,121 @@ private:
     bool m_UseEMFPlusFont;
     bool m_UseEMFPlusRaster;
     bool m_UseEMFPlusTextToPath;
+    double m_SimplifyTol; //in device units (<= 0 to disable)
+    double m_CurveFitTol; //in device units (<= 0 to disable)
+    bool m_Decimate; //skip exactly repeated (hidden) markers
+    static const int kMaxMarkerPts = 16; //larger polygons never markers
+    double m_RasterMaxDPI; //downsample rasters finer than this (<= 0 off)
+    static const int kMaxTileSide = 1024; //(in pixels) when tiling rasters
+    static const unsigned int kMaxTilePixels = 1 << 20; //larger are tiled
+    bool m_Buffering; //recording primitives to draw at end of page
+    PAGE::CPage m_Page;
+    PAGE::CPage m_Replay; //(page being drawn)
+    bool m_PlanSlots; //dry run each page to plan EMF+ object slots
+    bool m_Planning; //(during the dry run)
+    EMFPLUS::SObjectTrace m_Trace;
 
     //EMF states
-    double m_CurrHadj;
-    int m_CurrTextCol;
-    int m_CurrPolyFill;
-    double m_CurrClip[4];
+    STATE::CTracker m_State; //as written (clip & transforms lazily)
+    double m_CurrClip[4]; //as requested by R
 
     //EMF/EMF+ objects
     EMFPLUS::CObjectTable m_ObjectTable;
     EMF::CObjectTable m_ObjectTableEMF;
+    EMFPLUS::SPath m_Path; //reused for each path object (keeps storage)
 
     //system info for font metrics
     CFontInfoIndex m_FontInfoIndex;
+
+    //scratch space for geometry processing (reused between calls)
+    GEOM::CSimplifier m_Simplifier;
+    std::vector<int> m_SimplifiedNPts;
+    GEOM::CCurveFitter m_CurveFitter;
+    GEOM::CMarkerDecimator m_Decimator;
+    GEOM::CMarkerDecimator::TKey m_MarkerKey;
+    std::vector<GEOM::SBBox> m_HeldTextInk; //(R coordinates)
+    static const unsigned int kMaxHeldText = 256;
+    std::set<std::vector<float> > m_SeenShapes; //relative to first point
+    std::vector<float> m_ShapeKey;
+    std::vector<std::vector<float> > m_NewShapes; //(seen in dry run)
+    std::set<std::vector<float> > m_ShapesBefore; //(if cleared in dry run)
+    bool m_ShapesCleared;
+    static const unsigned int kMaxSeenShapes = 4096;
+
+    //consecutive EMF+ shapes sharing one style and not overlapping
+    //one another (so that drawing all fills then all outlines, rather
+    //than alternating, does not change the image), or consecutive
+    //lines sharing one pen
+    struct SBatch {
+        EBatchKind m_Kind;
+        bool m_Disjoint; //whether members must not overlap
+        R_GE_gcontext m_GC;
+        std::vector<GEOM::SBBox> m_Ink;
+        std::vector<double> m_X, m_Y, m_R; //vertices/centres & radii
+        std::vector<int> m_NPts;
+        unsigned int m_NPathPts;
+        static const unsigned int kMaxShapes = 512;
+        static const unsigned int kMaxPathPts = 4096;
+
+        SBatch(void) :
+            m_Kind(eBatchNone), m_Disjoint(true), m_NPathPts(0) {}
+        void Start(EBatchKind kind, const pGEcontext gc, bool disjoint) {
+            m_Kind = kind;
+            m_Disjoint = disjoint;
+            m_GC = *gc;
+        }
+        void Add(int n, const double *x, const double *y, double r) {
+            m_X.insert(m_X.end(), x, x+n);
+            m_Y.insert(m_Y.end(), y, y+n);
+            m_R.push_back(r);
+            m_NPts.push_back(n);
+        }
+        void Clear(void) {
+            m_Kind = eBatchNone;
+            m_Ink.clear();
+            m_X.clear(); m_Y.clear(); m_R.clear();
+            m_NPts.clear();
+            m_NPathPts = 0;
+        }
+        bool Accepts(EBatchKind kind, const GEOM::SBBox &ink,
+                     unsigned int nPts, const pGEcontext gc) const {
+            if (kind != m_Kind  ||  m_Ink.size() >= kMaxShapes  ||
+                m_NPathPts + nPts > kMaxPathPts  ||
+                gc->col != m_GC.col  ||
+                (kind != eBatchLines  &&  gc->fill != m_GC.fill)  ||
+                gc->lwd != m_GC.lwd  ||  gc->lty != m_GC.lty  ||
+                gc->lend != m_GC.lend  ||  gc->ljoin != m_GC.ljoin  ||
+                gc->lmitre != m_GC.lmitre) {
+                return false;
+            }
+            for (unsigned int i = 0;  m_Disjoint  &&  i < m_Ink.size();
+                 ++i) {
+                if (m_Ink[i].Intersects(ink)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    } m_Batch;
+
+    //counts of primitives skipped because they cannot be seen (or
+    //are hidden under an identical copy)
+    struct SCullStats {
+        unsigned int nPrimitives, nOutside, nInvisible, nDegenerate;
+        unsigned int nRepeated, nCollapsed;
+    } m_CullStats;
+
+    //operations recorded on buffered pages, and how many each pass
+    //removed (or moved)
+    struct SPageStats {
+        unsigned int nOps, nClips, nRepeats, nCulled, nMoved;
+    } m_PageStats;
+
+    //bytes of EMF+ object records written for planned pages, and
+    //what LRU would have written instead
+    struct SPlanStats {
+        double bytesWritten, bytesLRU;
+    } m_PlanStats;
 };
 
 // R callbacks below (declare extern "C")
@@ -403,6 +1032,11 @@ bool CDevEMF::Open(const char* filename, int width, int height)
     if (m_debug) Rprintf("open: %i, %i\n", width, height);
     m_Width = width;
     m_Height = height;
+    if (m_Decimate) {
+        m_Decimator.Init(m_Width, m_Height);
+    }
+    m_Page.Init(m_Width, m_Height);
+    m_Replay.Init(m_Width, m_Height);
     
     m_File.open(R_ExpandFileName(filename), ios_base::binary);
     if (!m_File) {
@@ -508,6 +1142,7 @@ bool CDevEMF::Open(const char* filename, int width, int height)
 }
 
 void CDevEMF::NewPage(const pGEcontext gc) {
+    x_DrawPage();
     if (++m_PageNum > 1) {
         Rf_warning("Multiple pages not available for EMF device");
     }
@@ -518,9 +1153,13 @@ void CDevEMF::NewPage(const pGEcontext gc) {
 }
 
 
-void CDevEMF::Clip(double x0, double x1, double y0, double y1)
+void CDevEMF::Clip(double x0, double x1, double y0, double y1, bool replay)
 {
     if (m_debug) Rprintf("clip %f,%f,%f,%f\n", x0,y0,x1,y1);
+    if (m_Buffering  &&  !replay) {
+        m_Page.AddClip(x0, x1, y0, y1);
+        return;
+    }
     if ((m_CurrClip[0] == x0  &&
          m_CurrClip[1] == y0  &&
          m_CurrClip[2] == x1  &&
@@ -531,23 +1170,15 @@ void CDevEMF::Clip(double x0, double x1, double y0, double y1)
          m_CurrClip[3] != -1)) {
         return; //skip if unchanged
     }
+    x_FlushBatch();
     m_CurrClip[0] = x0;
     m_CurrClip[1] = y0;
     m_CurrClip[2] = x1;
     m_CurrClip[3] = y1;
     x_TransformY(&y0, 1);
     x_TransformY(&y1, 1);
-    if (m_UseEMFPlus) {
-        EMFPLUS::SSetClipRect clip(EMFPLUS::eCombineModeReplace, x0,y0,x1,y1);
-        clip.Write(m_File);
-    }
-    //also do EMF clipping if possibly using any EMF records
-    if (!m_UseEMFPlus  ||  !m_UseEMFPlusFont  ||  !m_UseEMFPlusRaster)  {
-        EMF::S_EXTSELECTCLIPRGN rgn;//reset to default
-        rgn.Write(m_File);
-        EMF::S_INTERSECTCLIPRECT rect(x0,y0,x1,y1);
-        rect.Write(m_File);
-    }
+    //written (for EMF+ and/or EMF) only once something is drawn
+    m_State.SetClip(x0, y0, x1, y1);
     return;
 }
 
@@ -555,7 +1186,38 @@ void CDevEMF::Clip(double x0, double x1, double y0, double y1)
 void CDevEMF::Close(void)
 {
     if (m_debug) Rprintf("close\n");
+    x_DrawPage();
+    x_FlushBatch();
+    if (m_Stats) Rprintf("culled %u of %u primitives (%u outside clip, "
+                         "%u invisible, %u degenerate); %u drawn as dots\n",
+                         m_CullStats.nOutside + m_CullStats.nInvisible +
+                         m_CullStats.nDegenerate, m_CullStats.nPrimitives,
+                         m_CullStats.nOutside, m_CullStats.nInvisible,
+                         m_CullStats.nDegenerate, m_CullStats.nCollapsed);
+    if (m_Stats  &&  m_Buffering) {
+        Rprintf("buffered %u operations (%u clips elided, %u repeats, "
+                "%u culled, %u moved)\n", m_PageStats.nOps,
+                m_PageStats.nClips, m_PageStats.nRepeats,
+                m_PageStats.nCulled, m_PageStats.nMoved);
+    }
+    if (m_Stats  &&  m_Decimator.IsActive()) {
+        Rprintf("decimated %u repeated markers\n", m_CullStats.nRepeated);
+    }
+    if (m_Stats  &&  m_UseEMFPlus) {
+        const EMFPLUS::SObjectTableStats &stats = m_ObjectTable.GetStats();
+        Rprintf("EMF+ objects: %u reused, %u written (%.0f bytes), "
+                "%u evicted, %u re-emitted (%.0f bytes)\n",
+                stats.nHits, stats.nWritten, stats.bytesWritten,
+                stats.nEvictions, stats.nReEmitted, stats.bytesReEmitted);
+    }
+    if (m_Stats  &&  m_PlanSlots) {
+        Rprintf("planned EMF+ objects: %.0f bytes written (%.0f saved "
+                "compared with LRU from the same table at the start of "
+                "each page)\n", m_PlanStats.bytesWritten,
+                m_PlanStats.bytesLRU - m_PlanStats.bytesWritten);
+    }
 
+    x_ReleaseHeldText();
     if (m_UseEMFPlus) {
         EMFPLUS::SEndOfFile empr;
         empr.Write(m_File);
@@ -587,31 +1249,65 @@ void CDevEMF::Raster(unsigned int* r, int w, int h, double x, double y,
                      double width, double height, double rot,
                      Rboolean interpolate) {
     if (m_debug) Rprintf("raster: %d,%d / %f,%f,%f,%f\n", w,h,x,y,width,height);
-    
+    x_DrawPage(); //(pixels are not recorded)
+    x_FlushBatch();
+
+    {//cull using corners of (possibly rotated) destination rectangle
+        GEOM::SBBox bbox = x_RotatedRectBBox(x, y, width, height, rot);
+        ++m_CullStats.nPrimitives;
+        if (w <= 0  ||  h <= 0  ||  bbox.HasZeroArea()) {
+            ++m_CullStats.nDegenerate;
+            return;
+        }
+        if (!bbox.Intersects(x_VisibleRegion())) {
+            ++m_CullStats.nOutside;
+            return;
+        }
+        x_Cover(bbox);
+        x_ReleaseHeldText(bbox);
+    }
+    //drop pixels that cannot be shown at the requested resolution
+    std::vector<unsigned int> resampled;
+    if (m_RasterMaxDPI > 0) {
+        double maxW = ceil(fabs(width)/m_CoordDPI*m_RasterMaxDPI);
+        double maxH = ceil(fabs(height)/m_CoordDPI*m_RasterMaxDPI);
+        maxW = maxW < 1 ? 1 : maxW;
+        maxH = maxH < 1 ? 1 : maxH;
+        if (w > maxW  ||  h > maxH) {
+            int dstW = w > maxW ? (int) maxW : w;
+            int dstH = h > maxH ? (int) maxH : h;
+            if (m_debug) Rprintf("raster downsampled to %d,%d\n", dstW, dstH);
+            EMF::DownsampleRaster(r, w, h, dstW, dstH, interpolate,
+                                  resampled);
+            r = &resampled[0];
+            w = dstW;
+            h = dstH;
+        }
+    }
+    //split large rasters into tiles, so that no record (nor the
+    //buffer it is built in) holds more than kMaxTilePixels pixels
+    int tileW = w, tileH = h;
+    if ((size_t)w*h > kMaxTilePixels) {
+        tileW = min(w, (int) kMaxTileSide);
+        tileH = min(h, max(1, (int)(kMaxTilePixels/tileW)));
+    }
+    double rx = x, ry = y; //(R coordinates, for culling tiles)
+
     x_TransformY(&y, 1);//EMF has origin in upper left; R in lower left
     y -= height;
     /* Sigh.. as of 2016, LibreOffice support for EMF+ raster ops is broken/missing .*/
-    if (m_UseEMFPlus  &&  m_UseEMFPlusRaster) {
-        if (rot != 0) {
-            EMFPLUS::SMultiplyWorldTransform trans
-                (cos(rot*M_PI/180), -sin(rot*M_PI/180),
-                 sin(rot*M_PI/180), cos(rot*M_PI/180),
-                 x, y+height);
-            trans.Write(m_File);
-            x = 0; y = -height; //rotate around ll corner
-        }
-        EMFPLUS::SSetInterpolationMode m1
+    bool usePlus = m_UseEMFPlus  &&  m_UseEMFPlusRaster;
+    if (rot != 0) {
+        m_State.SetTransform(usePlus,
+                             STATE::SXForm::Rotation(rot, x, y+height));
+        x = 0; y = -height; //rotate around ll corner
+    }
+    m_State.Apply(usePlus, m_File);
+    if (usePlus) {
+        m_State.SetInterpolation
             (interpolate ?
              EMFPLUS::eInterpolationModeHighQualityBilinear:
-             EMFPLUS::eInterpolationModeNearestNeighbor);
-        m1.Write(m_File);
-        EMFPLUS::SDrawImage image(m_ObjectTable.GetImage(r,w,h,m_File), w,h,
-                                  x, y, width, height);
-        image.Write(m_File);
-        if (rot != 0) {
-            EMFPLUS::SResetWorldTransform trans;
-            trans.Write(m_File);
-        }
+             EMFPLUS::eInterpolationModeNearestNeighbor, m_File);
     } else {
         /* Unfortunately, I can't figure out a interpolation control
            for EMF -- so this seems to leave it up to the client
@@ -623,22 +1319,51 @@ void CDevEMF::Raster(unsigned int* r, int w, int h, double x, double y,
            m1.Write(m_File);
         }
         */
-        if (rot != 0) {
-            EMF::S_SETWORLDTRANSFORM emr;
-            emr.xform.Set(cos(rot*M_PI/180), -sin(rot*M_PI/180),
-                          sin(rot*M_PI/180), cos(rot*M_PI/180),
-                          x, y+height);
-            emr.Write(m_File);
-            x = 0; y = -height; //rotate around ll corner
-        }
-        EMF::S_STRETCHBLT bmp(r, w,h,x,y,width,height);
-        bmp.Write(m_File);
-        if (rot != 0) {
-            EMF::S_SETWORLDTRANSFORM emr;
-            emr.xform.Set(1,0,0,1, 0,0);
-            emr.Write(m_File);
+    }
+
+    double sx = width/w, sy = height/h; //size of one pixel
+    double c = cos(rot*M_PI/180), s = sin(rot*M_PI/180);
+    std::vector<unsigned int> tile;
+    for (int ty = 0;  ty < h;  ty += tileH) {
+        for (int tx = 0;  tx < w;  tx += tileW) {
+            int tw = min(tileW, w - tx), th = min(tileH, h - ty);
+            const unsigned int *data = r;
+            if (tw < w  ||  th < h) {
+                //skip tiles outside the clip region (tile origin is
+                //its lower left corner in R's coordinates)
+                double u = tx*sx, v = (h - ty - th)*sy;
+                if (!x_RotatedRectBBox(rx + u*c - v*s, ry + u*s + v*c,
+                                       tw*sx, th*sy, rot).
+                    Intersects(x_VisibleRegion())) {
+                    continue;
+                }
+                tile.resize((size_t)tw*th);
+                for (int j = 0;  j < th;  ++j) {
+                    const unsigned int *src = r + (size_t)(ty + j)*w + tx;
+                    std::copy(src, src + tw, tile.begin() + (size_t)j*tw);
+                }
+                data = &tile[0];
+            }
+            if (usePlus) {
+                EMFPLUS::SDrawImage image
+                    (m_ObjectTable.GetImage(data, tw, th, m_File), tw, th,
+                     x + tx*sx, y + ty*sy, tw*sx, th*sy);
+                image.Write(m_File);
+            } else {
+                //integer edges, so that adjacent tiles meet exactly
+                double x0 = floor(x + tx*sx + 0.5);
+                double y0 = floor(y + ty*sy + 0.5);
+                double x1 = floor(x + (tx + tw)*sx + 0.5);
+                double y1 = floor(y + (ty + th)*sy + 0.5);
+                EMF::S_STRETCHBLT bmp(data, tw, th, x0, y0, x1-x0, y1-y0);
+                bmp.Write(m_File);
+            }
         }
     }
+
+    if (rot != 0) {
+        m_State.ResetTransform(usePlus);
+    }
 }
 
 
@@ -655,47 +1380,176 @@ void CDevEMF::Line(double x1, double y1, double x2, double y2,
     }
 }
 
-void CDevEMF::Polyline(int n, double *x, double *y, const pGEcontext gc)
+void CDevEMF::Polyline(int n, const double *x, const double *y,
+                       const pGEcontext gc, bool replay)
 {
     if (m_debug) Rprintf("polyline\n");
 
-    x_TransformY(y, n);//EMF has origin in upper left; R in lower left
+    GEOM::SBBox bbox;
+    bbox.Extend(n, x, y);
+    if (!replay  &&  x_Defer(gc)) {
+        x_GrowToInk(bbox, gc);
+        m_Page.AddPoly(PAGE::eOpLine, n, x, y, gc, bbox);
+        return;
+    }
+    if (x_Cull(bbox, gc, false)) {
+        return;
+    }
+    x_Cover(bbox);
+    x_ReleaseHeldText(bbox);
+
+    if (m_UseEMFPlus  &&  m_CurveFitTol > 0  &&  n > 4  &&
+        x_DrawFittedCurves(n, x, y, gc)) {
+        return;
+    }
+    if (m_SimplifyTol > 0  &&  n > 2) {
+        m_Simplifier.Clear();
+        n = m_Simplifier.Append(n, x, y, m_SimplifyTol);
+        x = m_Simplifier.X();
+        y = m_Simplifier.Y();
+    }
+
+    if (x_AddToBatch(eBatchLines, bbox, n, gc)) {
+        m_Batch.Add(n, x, y, 0);
+        return;
+    }
+    x_DrawPolyline(n, x, y, gc);
+}
+
+void CDevEMF::x_DrawPolyline(int n, const double *x, const double *y,
+                             const pGEcontext gc)
+{
+    m_State.Apply(m_UseEMFPlus, m_File);
+    //y flipped by record (EMF has origin in upper left; R in lower left)
     if (m_UseEMFPlus) {
-        EMFPLUS::SDrawLines lines(n, x, y, x_GetPen(gc));
+        EMFPLUS::SDrawLines lines(n, x, y, m_Height, x_GetPen(gc));
         lines.Write(m_File);
     } else {
         x_GetPen(gc);
-        EMF::SPoly polyline(EMF::eEMR_POLYLINE, n, x, y);
+        EMF::SPoly polyline(EMF::eEMR_POLYLINE, n, x, y, m_Height);
         polyline.Write(m_File);
     }
 }
 
-void CDevEMF::Rect(double x0, double y0, double x1, double y1, const pGEcontext gc)
+void CDevEMF::Rect(double x0, double y0, double x1, double y1, const pGEcontext gc,
+                   bool replay)
 {
-    if (m_debug) Rprintf("rect (converted to poly)\n");
-
-    double x[4], y[4];
-    x[0] = x[1] = x0;
-    x[2] = x[3] = x1;
-    y[0] = y[3] = y0;
-    y[1] = y[2] = y1;
-    Polygon(4, x, y, gc);
+    if (m_debug) Rprintf("rect\n");
+
+    GEOM::SBBox bbox(x0, y0, x1, y1);
+    if (!replay  &&  x_Defer(gc)) {
+        double x[2], y[2]; //opposite corners
+        x[0] = x0; x[1] = x1;
+        y[0] = y0; y[1] = y1;
+        x_GrowToInk(bbox, gc);
+        m_Page.AddPoly(PAGE::eOpRect, 2, x, y, gc, bbox);
+        return;
+    }
+    if (x_Cull(bbox, gc, true)) {
+        return;
+    }
+    {//same marker key as the equivalent polygon
+        double cx[4], cy[4];
+        cx[0] = cx[1] = x0;
+        cx[2] = cx[3] = x1;
+        cy[0] = cy[3] = y0;
+        cy[1] = cy[2] = y1;
+        if (x_IsHiddenMarker(bbox, gc, 4, cx, cy, 0)) {
+            return;
+        }
+    }
+    x_ReleaseHeldText(bbox);
+    double x[2], y[2]; //opposite corners
+    x[0] = x0; x[1] = x1;
+    y[0] = y0; y[1] = y1;
+    if (x_AddToBatch(eBatchRects, bbox, 2, gc)) {
+        m_Batch.Add(2, x, y, 0);
+        return;
+    }
+    x_DrawRects(1, x, y, gc);
+}
+
+void CDevEMF::x_DrawRects(int n, const double *x, const double *y,
+                          const pGEcontext gc)
+{
+    m_State.Apply(m_UseEMFPlus, m_File);
+    //y flipped by record (EMF has origin in upper left; R in lower left)
+    if (m_UseEMFPlus) {
+        if (!R_TRANSPARENT(gc->fill)) {//solid colour given inline
+            EMFPLUS::SFillRects fill(n, x, y, m_Height, R_RED(gc->fill),
+                                     R_GREEN(gc->fill), R_BLUE(gc->fill),
+                                     R_ALPHA(gc->fill));
+            fill.Write(m_File);
+        } else {
+            int brushId = x_GetBrush(gc);
+            if (brushId >= 0) {//pattern fill
+                EMFPLUS::SFillRects fill(n, x, y, m_Height, brushId);
+                fill.Write(m_File);
+            }
+        }
+        if (!R_TRANSPARENT(gc->col)) {
+            EMFPLUS::SDrawRects drawRects(n, x, y, m_Height, x_GetPen(gc));
+            drawRects.Write(m_File);
+        }
+    } else {
+        x_GetPen(gc);
+        x_GetBrush(gc);
+        for (int i = 0;  i < n;  ++i, x += 2, y += 2) {
+            EMF::S_RECTANGLE emr;
+            emr.box.Set(floor(min(x[0], x[1]) + 0.5),
+                        floor(m_Height - max(y[0], y[1]) + 0.5),
+                        floor(max(x[0], x[1]) + 0.5),
+                        floor(m_Height - min(y[0], y[1]) + 0.5));
+            emr.Write(m_File);
+        }
+    }
 }
 
-void CDevEMF::Circle(double x, double y, double r, const pGEcontext gc)
+void CDevEMF::Circle(double x, double y, double r, const pGEcontext gc,
+                     bool replay)
 {
     if (m_debug) Rprintf("circle (%f,%f r=%f)\n", x, y,r);
 
+    GEOM::SBBox bbox(x-r, y-r, x+r, y+r);
+    if (!replay  &&  x_Defer(gc)) {
+        x_GrowToInk(bbox, gc);
+        m_Page.AddCircle(x, y, r, gc, bbox);
+        return;
+    }
+    GEOM::SBBox shape = bbox;
+    if (x_Cull(bbox, gc, true)  ||
+        x_IsHiddenMarker(bbox, gc, 1, &x, &y, r)  ||
+        x_Collapse(shape, bbox, gc)) {
+        return;
+    }
+    x_ReleaseHeldText(bbox);
+    if (x_AddToBatch(eBatchCircles, bbox, 13, gc)) {
+        m_Batch.Add(1, &x, &y, r);
+        return;
+    }
+    x_DrawCircle(x, y, r, gc);
+}
+
+void CDevEMF::x_DrawCircle(double x, double y, double r, const pGEcontext gc)
+{
     x_TransformY(&y, 1);//EMF has origin in upper left; R in lower left
+    m_State.Apply(m_UseEMFPlus, m_File);
     if (m_UseEMFPlus) {
-        {
+        if (!R_TRANSPARENT(gc->col)) {
             EMFPLUS::SDrawEllipse circle(x-r, y-r, 2*r, 2*r, x_GetPen(gc));
             circle.Write(m_File);
         }
-        int brushId = x_GetBrush(gc);
-        if (brushId >= 0) {//not transparent
-            EMFPLUS::SFillEllipse circle(x-r, y-r, 2*r, 2*r, brushId);
+        if (!R_TRANSPARENT(gc->fill)) {//solid colour given inline
+            EMFPLUS::SFillEllipse circle(x-r, y-r, 2*r, 2*r,
+                                         R_RED(gc->fill), R_GREEN(gc->fill),
+                                         R_BLUE(gc->fill), R_ALPHA(gc->fill));
             circle.Write(m_File);
+        } else {
+            int brushId = x_GetBrush(gc);
+            if (brushId >= 0) {//pattern fill
+                EMFPLUS::SFillEllipse circle(x-r, y-r, 2*r, 2*r, brushId);
+                circle.Write(m_File);
+            }
         }
     } else {
         x_GetPen(gc);
@@ -707,83 +1561,186 @@ void CDevEMF::Circle(double x, double y, double r, const pGEcontext gc)
     }
 }
 
-void CDevEMF::Polygon(int n, double *x, double *y, const pGEcontext gc)
+void CDevEMF::Polygon(int n, const double *x, const double *y,
+                      const pGEcontext gc, bool replay)
 {
     if (m_debug) { Rprintf("polygon"); for (int i = 0; i<n;  ++i) {Rprintf("(%f,%f) ", x[i], y[i]);}; Rprintf("\n");}
 
-    x_TransformY(y, n);//EMF has origin in upper left; R in lower left
+    GEOM::SBBox bbox;
+    bbox.Extend(n, x, y);
+    if (!replay  &&  x_Defer(gc)) {
+        x_GrowToInk(bbox, gc);
+        m_Page.AddPoly(PAGE::eOpPolygon, n, x, y, gc, bbox);
+        return;
+    }
+    GEOM::SBBox shape = bbox;
+    if (x_Cull(bbox, gc, true)) {
+        return;
+    }
+    if (n <= kMaxMarkerPts) { //e.g., squares, triangles, diamonds
+        if (x_IsHiddenMarker(bbox, gc, n, x, y, 0)) {
+            return;
+        }
+    } else {
+        x_Cover(bbox);
+    }
+    if (x_Collapse(shape, bbox, gc)) {
+        return;
+    }
+    x_ReleaseHeldText(bbox);
+
+    if (m_SimplifyTol > 0  &&  n > 3) {
+        m_Simplifier.Clear();
+        int nKept = m_Simplifier.Append(n, x, y, m_SimplifyTol);
+        if (nKept >= 3) { //otherwise keep original outline
+            n = nKept;
+            x = m_Simplifier.X();
+            y = m_Simplifier.Y();
+        }
+    }
+
+    if (x_AddToBatch(eBatchPolygons, bbox, n, gc)) {
+        m_Batch.Add(n, x, y, 0);
+        return;
+    }
+    x_DrawPolygon(n, x, y, gc);
+}
+
+void CDevEMF::x_DrawPolygon(int n, const double *x, const double *y,
+                            const pGEcontext gc)
+{
+    //y flipped by record (EMF has origin in upper left; R in lower left)
     if (m_UseEMFPlus) {
-        int pathId = m_ObjectTable.GetPath(new EMFPLUS::SPath(1,x,y,&n),m_File);
-        int brushId = x_GetBrush(gc);
-        if (brushId >= 0) {//not transparent
-            EMFPLUS::SFillPath fill(pathId, brushId);
+        if (R_TRANSPARENT(gc->col)  &&  !R_TRANSPARENT(gc->fill)) {
+            //solid fill without outline needs no path object
+            m_State.Apply(true, m_File);
+            EMFPLUS::SFillPolygon fill(n, x, y, m_Height, gc->fill);
             fill.Write(m_File);
+            return;
+        }
+        //repeated small shapes (e.g., markers) share one path object
+        //(relative to first point) drawn with a translation
+        bool instance = n <= kMaxMarkerPts  &&  x_IsRepeatedShape(n, x, y);
+#if R_GE_version >= 13
+        //(pattern coordinates would move with the transform)
+        instance = instance  &&  (!R_TRANSPARENT(gc->fill)  ||
+                                  gc->patternFill == R_NilValue);
+#endif
+        int pathId;
+        if (instance) {
+            EMFPLUS::SPath &path = m_Path;
+            path.Clear();
+            path.StartNewPoly(0, 0);
+            for (int i = 1;  i < n;  ++i) { //float precision, so that
+                //equal shapes match regardless of position
+                path.AddLineTo((float) (x[i] - x[0]), (float) (y[0] - y[i]));
+            }
+            pathId = m_ObjectTable.GetPath(path, m_File);
+            m_State.SetTransform(true, STATE::SXForm::Translation
+                                 (x[0], m_Height - y[0]));
+        } else {
+            m_Path.Assign(1, x, y, &n, m_Height);
+            pathId = m_ObjectTable.GetPath(m_Path, m_File);
         }
+        m_State.Apply(true, m_File);
+        x_FillPath(pathId, gc);
         if (!R_TRANSPARENT(gc->col)) {
             EMFPLUS::SDrawPath drawPath(pathId, x_GetPen(gc));
             drawPath.Write(m_File);
         }
+        if (instance) {
+            m_State.ResetTransform(true);
+        }
     } else {
+        m_State.Apply(false, m_File);
         x_GetPen(gc);
         x_GetBrush(gc);
-        EMF::SPoly polygon(EMF::eEMR_POLYGON, n, x, y);
+        EMF::SPoly polygon(EMF::eEMR_POLYGON, n, x, y, m_Height);
         polygon.Write(m_File);
     }
 }
 
-void CDevEMF::Path(double *x, double *y, int nPoly, int *nPts, bool winding,
-                   const pGEcontext gc)
+void CDevEMF::Path(const double *x, const double *y, int nPoly,
+                   const int *nPts, bool winding, const pGEcontext gc,
+                   bool replay)
 {
     if (m_debug) { Rprintf("path\t(%d subpaths w/ %i winding)", nPoly, winding?1:0); }
+    x_FlushBatch();
 
-    int n = 0;
-    for (int i = 0;  i < nPoly;  ++i) {
-        n += nPts[i];
+    {
+        int n = 0;
+        for (int i = 0;  i < nPoly;  ++i) {
+            n += nPts[i];
+        }
+        GEOM::SBBox bbox;
+        bbox.Extend(n, x, y);
+        if (!replay  &&  x_Defer(gc)) {
+            x_GrowToInk(bbox, gc);
+            m_Page.AddPath(x, y, nPoly, nPts, winding, gc, bbox);
+            return;
+        }
+        if (x_Cull(bbox, gc, true)) {
+            return;
+        }
+        x_Cover(bbox);
+        x_ReleaseHeldText(bbox);
     }
-    x_TransformY(y, n);//EMF has origin in upper left; R in lower left
 
+    if (m_SimplifyTol > 0  &&  nPoly > 0) {
+        m_Simplifier.Clear();
+        m_SimplifiedNPts.resize(nPoly);
+        for (int i = 0, start = 0;  i < nPoly;  start += nPts[i++]) {
+            m_SimplifiedNPts[i] = m_Simplifier.Append(nPts[i], x+start,
+                                                      y+start, m_SimplifyTol);
+        }
+        x = m_Simplifier.X();
+        y = m_Simplifier.Y();
+        nPts = &m_SimplifiedNPts[0];
+    }
+
+    //y flipped by record (EMF has origin in upper left; R in lower left)
     if (m_UseEMFPlus) {
         // I can't find a way to make use of "winding" in EMF+
-        int pathId = m_ObjectTable.GetPath(new EMFPLUS::SPath(nPoly,x,y,nPts),
-                                           m_File);
+        m_Path.Assign(nPoly, x, y, nPts, m_Height);
+        int pathId = m_ObjectTable.GetPath(m_Path, m_File);
+        m_State.Apply(true, m_File);
         EMFPLUS::SDrawPath drawPath(pathId, x_GetPen(gc));
         drawPath.Write(m_File);
-        int brushId = x_GetBrush(gc);
-        if (brushId >= 0) {
-            EMFPLUS::SFillPath fill(pathId, brushId);
-            fill.Write(m_File);
-        }
+        x_FillPath(pathId, gc);
     } else {
         Rf_warning("devEMF does not implement 'path' drawing for EMF (only EMF+)");
         /*
-        if (( winding  &&  m_CurrPolyFill != EMF::ePF_WINDING)  ||
-            (!winding  &&  m_CurrPolyFill != EMF::ePF_ALTERNATE)) {
-            m_CurrPolyFill = (winding) ? EMF::ePF_WINDING : EMF::ePF_ALTERNATE;
-            EMF::S_SETPOLYFILLMODE emr;
-            emr.mode = m_CurrPolyFill;
-            emr.Write(m_File);
-        }
+        m_State.SetPolyFill(winding ? EMF::ePF_WINDING : EMF::ePF_ALTERNATE,
+                            m_File);
         */
     }
 }
 
 void CDevEMF::TextUTF8(double x, double y, const char *str, double rot,
-                       double hadj, const pGEcontext gc)
+                       double hadj, const pGEcontext gc, bool replay)
 {
     if (m_debug) Rprintf("textUTF8: %s, %x  at %.1f %.1f\n", str, gc->col, x, y);
+    SSysFontInfo *info = x_GetFontInfo(gc);
+    if (!replay  &&  x_Defer(gc)) {
+        m_Page.AddText(x, y, str, rot, hadj, gc,
+                       x_TextInk(x, y, str, rot, hadj, gc, info));
+        return;
+    }
+    x_FlushBatch();
     x_TransformY(&y, 1);//EMF has origin in upper left; R in lower left
 
-    SSysFontInfo *info = x_GetFontInfo(gc);
+    if (m_Decimator.IsActive()  &&  !info) { //width unknown: whole page
+        x_Cover(GEOM::SBBox(0, 0, m_Width, m_Height));
+    } else if (m_Decimator.IsActive()) { //generous enough for any rotation
+        double extent = info->GetStrWidth(str) +
+            2 * x_EffPointsize(gc)/72. * Inches2Dev(1);
+        x_Cover(GEOM::SBBox(x - extent, m_Height - y - extent,
+                            x + extent, m_Height - y + extent));
+    }
     if (m_UseEMFPlus  &&  m_UseEMFPlusTextToPath) { // pseudo-embed fonts
         //rotate & translate
-        EMFPLUS::SMultiplyWorldTransform trans
-            (cos(rot*M_PI/180), -sin(rot*M_PI/180),
-             sin(rot*M_PI/180), cos(rot*M_PI/180),
-             x, y);
-        trans.Write(m_File);
-        EMFPLUS::STranslateWorldTransform startAlign
-            (-hadj*info->GetStrWidth(str), 0);
-        startAlign.Write(m_File);
+        m_State.SetTransform(true, STATE::SXForm::Rotation(rot, x, y));
+        m_State.Translate(-hadj*info->GetStrWidth(str), 0, m_File);
 
         //draw string -- have to convert UTF8 to UTF32
         unsigned int length = strlen(str);
@@ -792,33 +1749,28 @@ void CDevEMF::TextUTF8(double x, double y, const char *str, double rot,
         ch2 = SSysFontInfo::UTF8toUTF32(str, &len2);
         for (unsigned int i = 0;  i < length;  i += len1) {
             len1 = len2; ch1 = ch2;
-            EMFPLUS::SPath *path = new EMFPLUS::SPath;
-            info->AppendGlyphPath(ch1, *path);
+            EMFPLUS::SPath &path = m_Path;
+            path.Clear();
+            info->AppendGlyphPath(ch1, path);
             int pathId = m_ObjectTable.GetPath(path, m_File);
             EMFPLUS::SFillPath fill(pathId, R_RED(gc->col), R_GREEN(gc->col),
                                     R_BLUE(gc->col), R_ALPHA(gc->col));
             fill.Write(m_File);
             if (i + len1 < length) {
                 ch2 = SSysFontInfo::UTF8toUTF32(str+i+len1, &len2);
-                EMFPLUS::STranslateWorldTransform
-                    advance(info->GetAdvance(ch1, ch2), 0);
-                advance.Write(m_File);
+                m_State.Translate(info->GetAdvance(ch1, ch2), 0, m_File);
             }
         }
 
         //reset rotation
-        EMFPLUS::SResetWorldTransform reset;
-        reset.Write(m_File);
+        m_State.ResetTransform(true);
         
     } else if (m_UseEMFPlus  &&  m_UseEMFPlusFont) { //Use EMF+ fonts
         if (rot != 0) {
-            EMFPLUS::SMultiplyWorldTransform trans
-                (cos(rot*M_PI/180), -sin(rot*M_PI/180),
-                 sin(rot*M_PI/180), cos(rot*M_PI/180),
-                 x, y);
-            trans.Write(m_File);
+            m_State.SetTransform(true, STATE::SXForm::Rotation(rot, x, y));
             x = 0; y = 0; //because already translated!
         }
+        m_State.Apply(true, m_File);
         EMFPLUS::SDrawString text
             (iConvUTF8toUTF16LE(str), gc->col, x_GetFont(gc, info),
              m_ObjectTable.GetStringFormat(hadj < 0.5 ? EMFPLUS::eStrAlignNear:
@@ -837,34 +1789,15 @@ void CDevEMF::TextUTF8(double x, double y, const char *str, double rot,
         text.m_LayoutRect.y = y - ascent;//find baseline
         text.Write(m_File);
         if (rot != 0) {
-            EMFPLUS::SResetWorldTransform trans;
-            trans.Write(m_File);
+            m_State.ResetTransform(true);
         }
     } else { //otherwise EMF fonts
-        x_GetFont(gc, info, rot);//inserts & selects font
-        /* Commented out because Using rotation built into EMF font support; not as elegant but better supported by viewing/editing programs.
-        if (rot != 0) {
-            EMF::S_SETWORLDTRANSFORM emr;
-            emr.xform.Set(cos(rot*M_PI/180), -sin(rot*M_PI/180),
-                          sin(rot*M_PI/180), cos(rot*M_PI/180),
-                          x, y);
-            emr.Write(m_File);
-            x = 0; y = 0; //because already translated!
-        }
-        */
-
-        if (m_CurrTextCol != gc->col) {
-            x_SetEMFTextColor(gc->col);
-        }
-        if (m_CurrHadj != hadj) {
-            EMF::S_SETTEXTALIGN emr;
-            emr.mode = (hadj < 0.5) ?
-                EMF::eTA_BASELINE|EMF::eTA_LEFT :
-                (hadj == 0.5 ? EMF::eTA_BASELINE|EMF::eTA_CENTER :
-                 EMF::eTA_BASELINE|EMF::eTA_RIGHT);
-            emr.Write(m_File);
-            m_CurrHadj = hadj;
-        }
+        //(everything that can raise an R condition comes before records
+        //are held back, so that an error cannot leave them held)
+        bool hold = m_UseEMFPlus  &&  m_File.inEMFplus  &&  info;
+        SSysFontInfo *fontInfo = info ? info : x_GetFontInfo(gc);
+        string family = iConvUTF8toUTF16LE(fontInfo->m_Spec.m_Family);
+        x_WarnEMFTextColor(gc->col);
 
         EMF::S_EXTTEXTOUTW emr;
         emr.bounds.Set(0,0,0,0);//EMF spec says to ignore
@@ -901,7 +1834,37 @@ void CDevEMF::TextUTF8(double x, double y, const char *str, double rot,
         //spec wants # advances = # characters, but maybe last is unused?
         emr.emrtext.dx.push_back(info->GetAdvance(nextCh, nextCh));
 
+        //among EMF+ records, hold back (see x_ReleaseHeldText)
+        m_File.holdEMF = hold;
+        m_ObjectTableEMF.GetFont(fontInfo->m_Spec.m_Face,
+                                 fontInfo->m_Spec.m_Size, family, rot,
+                                 m_File);//inserts & selects font
+        /* Commented out because Using rotation built into EMF font support; not as elegant but better supported by viewing/editing programs.
+        if (rot != 0) {
+            EMF::S_SETWORLDTRANSFORM emr;
+            emr.xform.Set(cos(rot*M_PI/180), -sin(rot*M_PI/180),
+                          sin(rot*M_PI/180), cos(rot*M_PI/180),
+                          x, y);
+            emr.Write(m_File);
+            x = 0; y = 0; //because already translated!
+        }
+        */
+
+        m_State.Apply(false, m_File);
+        m_State.SetTextColor(gc->col, m_File);
+        m_State.SetTextAlign((hadj < 0.5) ?
+                             EMF::eTA_BASELINE|EMF::eTA_LEFT :
+                             (hadj == 0.5 ? EMF::eTA_BASELINE|EMF::eTA_CENTER :
+                              EMF::eTA_BASELINE|EMF::eTA_RIGHT), m_File);
         emr.Write(m_File);
+        m_File.holdEMF = false;
+        if (hold) {
+            m_HeldTextInk.push_back(x_TextInk(x, m_Height - y, str, rot,
+                                              hadj, gc, info));
+            if (m_HeldTextInk.size() >= kMaxHeldText) {
+                x_ReleaseHeldText();
+            }
+        }
         /* Commented out for same reason as above
         if (rot != 0) {
             EMF::S_SETWORLDTRANSFORM emr;
@@ -919,12 +1882,16 @@ Rboolean EMFDeviceDriver(pDevDesc dd, const char *filename,
                          double width, double height, double pointsize,
                          const char *family, int coordDPI, bool customLty,
                          bool emfPlus, bool emfpFont, bool emfpRaster,
-                         bool emfpEmbed)
+                         bool emfpEmbed, double simplify, double curveFit,
+                         bool decimate, EMFPLUS::ESlotPolicy cachePolicy,
+                         double rasterMaxDPI, bool bufferPage, bool stats)
 {
     CDevEMF *emf;
 
     if (!(emf = new CDevEMF(family, coordDPI, customLty, emfPlus, emfpFont,
-                            emfpRaster, emfpEmbed))){
+                            emfpRaster, emfpEmbed, simplify, curveFit,
+                            decimate, cachePolicy, rasterMaxDPI,
+                            bufferPage, stats))){
 	return FALSE;
     }
     dd->deviceSpecific = (void *) emf;
@@ -1023,15 +1990,26 @@ Rboolean EMFDeviceDriver(pDevDesc dd, const char *filename,
  *  emfPlus = whether to use EMF+ format
  *  emfpFont = whether to use EMF+ text records
  *  emfpRaster = whether to use EMF+ raster records
+ *  emfpEmbed = whether to convert text to EMF+ paths
+ *  simplify = tolerance (device units) for simplifying lines (0 = off)
+ *  curveFit = tolerance (device units) for fitting curves to lines (0 = off)
+ *  decimate = whether to skip markers hidden under identical copies
+ *  emfpCache = replacement policy for EMF+ object table ("cost", "lru"
+ *              or "optimal")
+ *  rasterMaxDPI = resolution above which rasters are downsampled (0 = off)
+ *  bufferPage = whether to record & optimize each page before writing it
  */
 extern "C" {
 SEXP devEMF(SEXP args)
 {
     pGEDevDesc dd;
-    const char *file, *bg, *fg, *family;
+    const char *file, *bg, *fg, *family, *cache;
     double height, width, pointsize;
-    Rboolean userLty, emfPlus, emfpFont, emfpRaster, emfpEmbed;
+    Rboolean userLty, emfPlus, emfpFont, emfpRaster, emfpEmbed, decimate;
+    Rboolean bufferPage, stats;
+    EMFPLUS::ESlotPolicy cachePolicy;
     int coordDPI;
+    double simplify, curveFit, rasterMaxDPI;
 
     args = CDR(args); /* skip entry point name */
     file = Rf_translateChar(Rf_asChar(CAR(args))); args = CDR(args);
@@ -1047,6 +2025,16 @@ SEXP devEMF(SEXP args)
     emfpFont = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
     emfpRaster = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
     emfpEmbed = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
+    simplify = Rf_asReal(CAR(args));     args = CDR(args);
+    curveFit = Rf_asReal(CAR(args));     args = CDR(args);
+    decimate = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
+    cache = CHAR(Rf_asChar(CAR(args)));     args = CDR(args);
+    cachePolicy = strcmp(cache, "lru") == 0 ? EMFPLUS::eSlotPolicyLRU :
+        strcmp(cache, "optimal") == 0 ? EMFPLUS::eSlotPolicyPlanned :
+        EMFPLUS::eSlotPolicyCost;
+    rasterMaxDPI = Rf_asReal(CAR(args));     args = CDR(args);
+    bufferPage = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
+    stats = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
 
     R_GE_checkVersionOrDie(R_GE_version);
     R_CheckDeviceAvailable();
@@ -1056,7 +2044,9 @@ SEXP devEMF(SEXP args)
 	    return 0;
 	if(!EMFDeviceDriver(dev, file, bg, fg, width, height, pointsize,
                             family, coordDPI, userLty, emfPlus, emfpFont,
-                            emfpRaster, emfpEmbed)) {
+                            emfpRaster, emfpEmbed, simplify, curveFit,
+                            decimate, cachePolicy, rasterMaxDPI,
+                            bufferPage, stats)) {
 	    free(dev);
 	    Rf_error("unable to start %s() device", "emf");
 	}
@@ -1067,7 +2057,7 @@ SEXP devEMF(SEXP args)
 }
 
     const R_ExternalMethodDef ExtEntries[] = {
-        {"devEMF", (DL_FUNC)&devEMF, 13},
+        {"devEMF", (DL_FUNC)&devEMF, 20},
 	{NULL, NULL, 0}
     };
     void R_init_devEMF(DllInfo *dll) {
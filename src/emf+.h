@@ -25,12 +25,15 @@
     --------------------------------------------------------------------------
 */
 
+#include <algorithm>
 #include <stdexcept>
 #include <string>
 #include <vector>
 #include <list>
+#include <map>
 
 #include "emf.h"
+#include "png.h"
 
 // structs for EMF+
 namespace EMFPLUS {
@@ -38,12 +41,14 @@ namespace EMFPLUS {
     using EMF::TUInt2;
     using EMF::TUInt1;
     using EMF::TFloat4;
+    using EMF::SObjectKey;
 
     enum ERecordType {
         eRcdHeader = 0x4001,
         eRcdEndOfFile = 0x4002,
         eRcdGetDC = 0x4004,
         eRcdObject = 0x4008,
+        eRcdFillRects = 0x400A,
         eRcdDrawRects = 0x400B,
         eRcdFillPolygon = 0x400C,
         eRcdDrawLines = 0x400D,
@@ -190,15 +195,6 @@ namespace EMFPLUS {
     const TUInt4 kVersion = 0xDBC01002; //specifies EMF+ and GDI+ version 1.1
     const unsigned int kMaxObjTableSize = 64; //max entries in object table
 
-    struct SPointF {
-        double x, y;
-        SPointF(void) { x = y = 0; }
-        SPointF(double xx, double yy) : x(xx), y(yy) {}
-        friend std::string& operator<< (std::string &o, const SPointF &d) {
-            return o << TFloat4(d.x) << TFloat4(d.y);
-        }
-    };
-
     struct SRectF {
         double x, y, w, h;
         SRectF(void) { x = y = w = h = 0; }
@@ -240,28 +236,33 @@ namespace EMFPLUS {
             return o << TUInt2(iType) << TUInt2(iFlags) << nSize << nDataSize;
         }
         void Write(EMF::ofstream &o) {
+            EMF::CScratchBuffer scratch(o);
+            std::string &buff = *scratch;
+            Serialize(buff);
+            buff.resize(((buff.size() + 3)/4)*4, '\0'); //add padding
+            x_Write(o, buff);
+        }
+    protected:
+        //writes a complete (padded) record, fixing its size fields
+        void x_Write(EMF::ofstream &o, std::string &buff) const {
             if (!o.inEMFplus) { //write encapsulating EMF record
                 EMF::SPlusRecord emr;
                 emr.Write(o);
                 o.emfPlusStartPos = o.tellp();
                 o.inEMFplus = true;
             }
-            std::string buff; Serialize(buff);
-            buff.resize(((buff.size() + 3)/4)*4, '\0'); //add padding
-            std::string dataSize; dataSize << TUInt4(buff.size()-12);
-            std::string finalSize; finalSize << TUInt4(buff.size());
-            buff.replace(4,4, finalSize);
-            buff.replace(8,4, dataSize);
+            TUInt4::Store(&buff[4], buff.size());
+            TUInt4::Store(&buff[8], buff.size()-12);
             o.write(buff.data(), buff.size());
 
             // update the size of the encapsulating EMF record
             std::streampos currPos = o.tellp();
             // back up to Size field
             o.seekp(o.emfPlusStartPos - (std::streampos)12);
-            buff.clear();
-            buff << TUInt4((int)(currPos - o.emfPlusStartPos) + 16)
-                 << TUInt4((int)(currPos - o.emfPlusStartPos) + 4);
-            o.write(buff.data(), buff.size());
+            char sizes[8];
+            TUInt4::Store(sizes, (int)(currPos - o.emfPlusStartPos) + 16);
+            TUInt4::Store(sizes+4, (int)(currPos - o.emfPlusStartPos) + 4);
+            o.write(sizes, sizeof(sizes));
             o.seekp(currPos);
 
             if (iType == eRcdEndOfFile) {
@@ -420,6 +421,83 @@ namespace EMFPLUS {
         EObjectType type;
         SObject(EObjectType t) : SRecord(eRcdObject), type(t) {}
         virtual ~SObject(void) {}
+        //objects with more data than this are split over a chain of
+        //continued-object records
+        static const unsigned int kMaxObjectChunk = 32000;
+        //objects that can generate any part of their data on demand
+        //(so large objects are streamed a chunk at a time) override
+        //these; by default the whole object is serialized up front
+        virtual size_t DataSize(void) const { return 0; }
+        virtual void AppendData(std::string &o, size_t from,
+                                size_t to) const {}
+        void Write(EMF::ofstream &o) {
+            EMF::CScratchBuffer scratch(o);
+            Write(o, *scratch);
+        }
+        //buff is empty or holds the object as serialized by GetKey
+        //(which is then written with this object's id, rather than
+        //serialized again)
+        void Write(EMF::ofstream &o, std::string &buff) {
+            if (!buff.empty()) {
+                TUInt2::Store(&buff[2], iFlags);
+            } else if (DataSize() == 0) {
+                Serialize(buff);
+            }
+            size_t total = buff.empty() ? DataSize() : buff.size() - 12;
+            size_t padded = ((total + 3)/4)*4;
+            if (padded <= kMaxObjectChunk) {
+                if (buff.empty()) {
+                    Serialize(buff);
+                }
+                buff.resize(12 + padded, '\0'); //add padding
+                x_Write(o, buff);
+                return;
+            }
+            //as GDI+ writes them, every record (the last included) has
+            //the continuation flag & total object size; readers (e.g.,
+            //LibreOffice) strip the size from each record and know the
+            //object is complete once the total has arrived
+            EMF::CScratchBuffer chunkScratch(o);
+            std::string &chunk = *chunkScratch;
+            for (size_t pos = 0;  pos < padded;  pos += kMaxObjectChunk) {
+                size_t n = std::min((size_t) kMaxObjectChunk, padded - pos);
+                chunk.clear();
+                chunk << TUInt2(iType) << TUInt2(iFlags | 0x8000) <<
+                    TUInt4(0) << TUInt4(0) << //sizes set by x_Write
+                    TUInt4(padded);
+                size_t start = chunk.size();
+                if (pos < total) {
+                    size_t end = std::min(pos + n, total);
+                    if (buff.empty()) {
+                        AppendData(chunk, pos, end);
+                    } else {
+                        chunk.append(buff, 12 + pos, end - pos);
+                    }
+                }
+                chunk.resize(start + n, '\0'); //(padding)
+                x_Write(o, chunk);
+            }
+        }
+        //by default, keys the serialized data, leaving the serialized
+        //object in buff for Write if it fits in one record (otherwise,
+        //for objects that generate their data on demand, it is
+        //fingerprinted a chunk at a time and buff is left empty)
+        virtual SObjectKey GetKey(std::string &buff) const {
+            buff.clear();
+            size_t total = DataSize();
+            if (total <= kMaxObjectChunk) {
+                Serialize(buff);
+                return SObjectKey(type, buff.data() + 12, buff.size() - 12);
+            }
+            EMF::SFingerprint print;
+            for (size_t pos = 0;  pos < total;  pos += kMaxObjectChunk) {
+                buff.clear();
+                AppendData(buff, pos, std::min(pos + kMaxObjectChunk, total));
+                print.AddBytes(buff.data(), buff.size());
+            }
+            buff.clear();
+            return SObjectKey(type, total, print);
+        }
         void SetObjId(unsigned char id) {
             iFlags = ((unsigned int)type << 8) | id;
         }
@@ -439,15 +517,13 @@ namespace EMFPLUS {
         struct SBlend {
             double pos;
             SColorRef col;
-            friend bool operator< (const SBlend &b1, const SBlend &b2) {
-                return memcmp(&b1, &b2, sizeof(SBlend)) < 0;
-            }
         };
         std::vector<SBlend> blendVector;
         SBrush(unsigned int c) : SObject(eTypeBrush),
                                  brushType(eBrushTypeSolidColor),
                                  color(c), wrapMode(eWrapModeTile) {}
-        SBrush(EBrushType bt) : SObject(eTypeBrush), brushType(bt) {}
+        SBrush(EBrushType bt) : SObject(eTypeBrush), brushType(bt),
+                                color(0), wrapMode(eWrapModeTile) {}
         std::string& Serialize(std::string &o) const {
             SObject::Serialize(o) << kVersion << TUInt4(brushType);
             switch(brushType) {
@@ -470,10 +546,6 @@ namespace EMFPLUS {
                 throw std::logic_error("unhandled brush type");
             }
         }
-        friend bool operator< (const SBrush& b1, const SBrush& b2) {
-            int cmp = memcmp(&b1.brushType, &b2.brushType, (char*)(&b1.blendVector) - (char*)&b1.brushType);
-            return (cmp < 0 || (cmp == 0  &&  b1.blendVector < b2.blendVector));
-        }
     };
 
     struct SPenData {
@@ -565,26 +637,41 @@ namespace EMFPLUS {
     };
 
     struct SPath : SObject {
-        std::vector<SPointF> m_Points;
-        std::vector<EPathPointType> m_PtType;
+        //points are stored at output precision, structure-of-arrays, so
+        //paths retained for comparison take 9 bytes per point
+        std::vector<float> m_X, m_Y;
+        std::vector<unsigned char> m_PtType; //EPathPointType
         std::vector<unsigned int> m_NPointsPerPoly;
         unsigned int m_TotalPts;
+        bool m_OpenFigures; //if true, subpaths are not closed (for stroking)
         
         SPath(void) : SObject(eTypePath) {
             m_TotalPts = 0;
-        }
-        SPath(unsigned int nPoly, double *x, double *y, int *nPts) :
-        SObject(eTypePath) {
-            m_NPointsPerPoly.reserve(nPoly);
+            m_OpenFigures = false;
+        }
+        //empties the path, keeping its storage (so one path can be
+        //reused for many objects without reallocating)
+        void Clear(void) {
+            m_X.clear();
+            m_Y.clear();
+            m_PtType.clear();
+            m_NPointsPerPoly.clear();
             m_TotalPts = 0;
+            m_OpenFigures = false;
+        }
+        //replaces the path by nPoly closed polygons
+        void Assign(unsigned int nPoly, const double *x, const double *y,
+                    const int *nPts, double yFlip) {
+            Clear();
             for (unsigned int i = 0;  i < nPoly;  ++i) {
                 m_NPointsPerPoly.push_back(nPts[i]);
                 m_TotalPts += nPts[i];
             }
-            m_Points.resize(m_TotalPts);
+            m_X.resize(m_TotalPts);
+            m_Y.resize(m_TotalPts);
             for (unsigned int i = 0;  i < m_TotalPts;  ++i) {
-                m_Points[i].x = x[i];
-                m_Points[i].y = y[i];
+                m_X[i] = x[i];
+                m_Y[i] = yFlip - y[i];
             }
             m_PtType.resize(m_TotalPts, ePathPointTypeLine);
             unsigned int ptI = 0;
@@ -595,18 +682,14 @@ namespace EMFPLUS {
         }
         void StartNewPoly(double x, double y) {
             m_NPointsPerPoly.push_back(1);
-            ++m_TotalPts;
-            m_Points.push_back(SPointF(x, y));
-            m_PtType.push_back(ePathPointTypeStart);
+            x_AddPoint(x, y, ePathPointTypeStart);
         }
         void AddLineTo(double x, double y) {
             if (m_NPointsPerPoly.empty()) {
                 throw std::logic_error("logic error in addlineto");
             }
             ++m_NPointsPerPoly.back();
-            ++m_TotalPts;
-            m_Points.push_back(SPointF(x, y));
-            m_PtType.push_back(ePathPointTypeLine);
+            x_AddPoint(x, y, ePathPointTypeLine);
         }
         void AddCubicBezierTo(double cx0, double cy0,
                               double cx1, double cy1,
@@ -615,129 +698,199 @@ namespace EMFPLUS {
                 throw std::logic_error("logic error in addcubicbezierto");
             }
             m_NPointsPerPoly.back() += 3;
-            m_TotalPts += 3;
-            m_Points.push_back(SPointF(cx0, cy0));
-            m_PtType.push_back(ePathPointTypeBezier);
-            m_Points.push_back(SPointF(cx1, cy1));
-            m_PtType.push_back(ePathPointTypeBezier);
-            m_Points.push_back(SPointF(x, y));
-            m_PtType.push_back(ePathPointTypeBezier);
+            x_AddPoint(cx0, cy0, ePathPointTypeBezier);
+            x_AddPoint(cx1, cy1, ePathPointTypeBezier);
+            x_AddPoint(x, y, ePathPointTypeBezier);
         }
         void AddQuadBezierTo(double cx, double cy,
                              double x, double y) {
-            if (m_Points.empty()) {
+            if (m_X.empty()) {
                 throw std::logic_error("logic error in quadbezierto");
             }
-            double x0 = m_Points.back().x;
-            double y0 = m_Points.back().y;
+            double x0 = m_X.back();
+            double y0 = m_Y.back();
             AddCubicBezierTo(x0 + (2./3)*(cx-x0), y0 + (2./3)*(cy-y0),
                              x + (2./3)*(cx-x), y + (2./3)*(cy-y),
                              x, y);
         }
         void CloseCurrPoly(void) {
             if (!m_NPointsPerPoly.empty()  &&  m_NPointsPerPoly.back() > 0) {
-                unsigned int startI = m_Points.size()-m_NPointsPerPoly.back();
-                if (!(m_Points.back().x == m_Points[startI].x  &&
-                      m_Points.back().y == m_Points[startI].y)) {
-                    AddLineTo(m_Points[startI].x, m_Points[startI].y);
+                unsigned int startI = m_X.size()-m_NPointsPerPoly.back();
+                if (!(m_X.back() == m_X[startI]  &&
+                      m_Y.back() == m_Y[startI])) {
+                    AddLineTo(m_X[startI], m_Y[startI]);
                 }
             }
         }
         std::string& Serialize(std::string &o) const {
             SObject::Serialize(o);
-            o << kVersion << TUInt4(m_TotalPts) << TUInt4(0);
-            for (unsigned int i = 0;  i < m_TotalPts;  ++i) {
-                o << m_Points[i];
+            AppendData(o, 0, DataSize());
+            return o;
+        }
+        //object data is: 12 byte header, points (8 bytes each), then
+        //point types (1 byte each)
+        size_t DataSize(void) const {
+            return 12 + 9*(size_t)m_TotalPts;
+        }
+        //generates just the requested part of the data, straight from
+        //the point storage
+        void AppendData(std::string &o, size_t from, size_t to) const {
+            const size_t ptsStart = 12;
+            const size_t typesStart = ptsStart + 8*(size_t)m_TotalPts;
+            if (from < ptsStart) {
+                char header[ptsStart];
+                memcpy(header, kVersion.m_Val, 4);
+                TUInt4::Store(header + 4, m_TotalPts);
+                TUInt4::Store(header + 8, 0);
+                o.append(header + from, std::min(to, ptsStart) - from);
             }
-            unsigned int polyStart = 0;
-            for (unsigned int i = 0;  i < m_NPointsPerPoly.size();  ++i) {
-                for (unsigned int j = 0;  j < m_NPointsPerPoly[i];  ++j) {
-                    if (j < m_NPointsPerPoly[i] - 1) { //normal point
-                        o << TUInt1((0x2 << 4) | m_PtType[j+polyStart]);
+            if (from < typesStart  &&  to > ptsStart) {
+                //whole points are stored straight into o, then any partial
+                //point at either end of the range is trimmed off
+                size_t p0 = from > ptsStart ? (from - ptsStart)/8 : 0;
+                size_t p1 = std::min((to - ptsStart + 7)/8,
+                                     (size_t)m_TotalPts);
+                size_t start = o.size();
+                o.resize(start + 8*(p1 - p0));
+                char *dst = &o[start];
+                for (size_t i = p0;  i < p1;  ++i, dst += 8) {
+                    TFloat4::Store(dst, m_X[i]);
+                    TFloat4::Store(dst + 4, m_Y[i]);
+                }
+                size_t skip = from > ptsStart ? (from - ptsStart) % 8 : 0;
+                o.erase(start, skip);
+                o.resize(start + std::min(to, typesStart) -
+                         std::max(from, ptsStart));
+            }
+            if (to > typesStart) {
+                size_t t0 = from > typesStart ? from - typesStart : 0;
+                size_t t1 = to - typesStart;
+                //find the polygon holding point t0
+                unsigned int poly = 0;
+                size_t polyEnd = m_NPointsPerPoly.empty() ? 0 :
+                    m_NPointsPerPoly[0];
+                while (polyEnd <= t0  &&  poly+1 < m_NPointsPerPoly.size()) {
+                    polyEnd += m_NPointsPerPoly[++poly];
+                }
+                for (size_t i = t0;  i < t1;  ++i) {
+                    while (i >= polyEnd) {
+                        polyEnd += m_NPointsPerPoly[++poly];
+                    }
+                    if (i < polyEnd - 1  ||  m_OpenFigures) {
+                        //normal point
+                        o << TUInt1((0x2 << 4) | m_PtType[i]);
                     } else {//close path
-                        o << TUInt1((0x8 << 4) | m_PtType[j+polyStart]); 
+                        o << TUInt1((0x8 << 4) | m_PtType[i]);
                     }
                 }
-                polyStart += m_NPointsPerPoly[i];
             }
-            return o;
         }
-        friend bool operator< (const SPath& p1, const SPath& p2) {
-            if (p1.m_TotalPts < p2.m_TotalPts) {
-                return true;
-            } else if (p1.m_TotalPts > p2.m_TotalPts) {
-                return false;
-            }
-            int cmp = memcmp(p1.m_Points.data(),  p2.m_Points.data(),
-                             sizeof(SPointF)*p1.m_TotalPts);
-            if (cmp < 0) {
-                return true;
-            } else if (cmp > 0) {
-                return false;
-            }
-            cmp = memcmp(p1.m_PtType.data(),  p2.m_PtType.data(),
-                         sizeof(EPathPointType)*p1.m_TotalPts);
-            if (cmp < 0) {
-                return true;
-            } else if (cmp > 0) {
-                return false;
-            }
-            
-            return (memcmp(p1.m_NPointsPerPoly.data(),
-                           p2.m_NPointsPerPoly.data(),
-                           sizeof(unsigned int)*p1.m_NPointsPerPoly.size())
-                    < 0);
+    private:
+        void x_AddPoint(double x, double y, EPathPointType type) {
+            ++m_TotalPts;
+            m_X.push_back(x);
+            m_Y.push_back(y);
+            m_PtType.push_back(type);
         }
     };
              
     struct SFillPolygon : SRecord {
         SColorRef m_Brush;
         unsigned int m_Count;
-        SPointF *m_Points;
-        SFillPolygon(int n, double *x, double *y,
+        const double *m_X, *m_Y; //not owned; y given in R orientation
+        double m_YFlip;
+        SFillPolygon(int n, const double *x, const double *y, double yFlip,
                      unsigned int col) :
-            SRecord(eRcdFillPolygon), m_Brush(col), m_Points(new SPointF[n]) {
+            SRecord(eRcdFillPolygon), m_Brush(col), m_Count(n),
+            m_X(x), m_Y(y), m_YFlip(yFlip) {
             iFlags = 1 << 15; //specify solid brush, color given here
-            m_Count = n;
-            for (unsigned int i = 0;  i < m_Count;  ++i) {
-                m_Points[i].x = x[i];
-                m_Points[i].y = y[i];
-            }
         }
-        ~SFillPolygon(void) { delete[] m_Points; }
         std::string& Serialize(std::string &o) const {
             SRecord::Serialize(o);
             o << m_Brush << TUInt4(m_Count);
-            for (unsigned int i = 0;  i < m_Count;  ++i) {
-                o << m_Points[i];
+            EMF::AppendPointsFloat4(o, m_Count, m_X, m_Y, m_YFlip);
+            return o;
+	}
+    };
+
+    //appends n rectangles as TFloat4 (x,y,w,h), each given by
+    //opposite corners (x[2i],y[2i]) and (x[2i+1],y[2i+1])
+    inline void AppendRectsF(std::string &o, unsigned int n,
+                             const double *x, const double *y,
+                             double yFlip) {
+        for (unsigned int i = 0;  i < n;  ++i, x += 2, y += 2) {
+            double y0 = yFlip - y[0], y1 = yFlip - y[1];
+            o << TFloat4(std::min(x[0], x[1])) << TFloat4(std::min(y0, y1))
+              << TFloat4(fabs(x[1] - x[0])) << TFloat4(fabs(y1 - y0));
+        }
+    }
+
+    struct SFillRects : SRecord {
+        TUInt4 m_BrushId;
+        SColorRef m_Col;
+        bool m_SimpleBrush;
+        unsigned int m_Count;
+        const double *m_X, *m_Y; //not owned; y given in R orientation
+        double m_YFlip;
+        SFillRects(int n, const double *x, const double *y, double yFlip,
+                   unsigned char r, unsigned char g, unsigned char b,
+                   unsigned char a) :
+            SRecord(eRcdFillRects), m_SimpleBrush(true), m_Count(n),
+            m_X(x), m_Y(y), m_YFlip(yFlip) {
+            iFlags = 1 << 15; //specify solid brush, color given here
+            m_Col.Set(r,g,b,a);
+        }
+        SFillRects(int n, const double *x, const double *y, double yFlip,
+                   unsigned char brushId) :
+            SRecord(eRcdFillRects), m_SimpleBrush(false), m_Count(n),
+            m_X(x), m_Y(y), m_YFlip(yFlip) {
+            iFlags = 0;
+            m_BrushId = brushId;
+        }
+        std::string& Serialize(std::string &o) const {
+            SRecord::Serialize(o);
+            if (m_SimpleBrush) {
+                o << m_Col;
+            } else {
+                o << m_BrushId;
             }
+            o << TUInt4(m_Count);
+            AppendRectsF(o, m_Count, m_X, m_Y, m_YFlip);
+            return o;
+	}
+    };
+
+    struct SDrawRects : SRecord {
+        unsigned int m_Count;
+        const double *m_X, *m_Y; //not owned; y given in R orientation
+        double m_YFlip;
+        SDrawRects(int n, const double *x, const double *y, double yFlip,
+                   unsigned char penId) :
+            SRecord(eRcdDrawRects), m_Count(n),
+            m_X(x), m_Y(y), m_YFlip(yFlip) {
+            iFlags = penId;
+        }
+        std::string& Serialize(std::string &o) const {
+            SRecord::Serialize(o) << TUInt4(m_Count);
+            AppendRectsF(o, m_Count, m_X, m_Y, m_YFlip);
             return o;
 	}
     };
 
     struct SDrawLines : SRecord {
         unsigned int count;
-        SPointF *points;
-        SDrawLines(int n, double *x, double *y, unsigned char penId,
-                   bool close = false) :
-            SRecord(eRcdDrawLines), points(new SPointF[n+(close?1:0)]) {
+        const double *m_X, *m_Y; //not owned; y given in R orientation
+        double m_YFlip;
+        bool m_Close;
+        SDrawLines(int n, const double *x, const double *y, double yFlip,
+                   unsigned char penId, bool close = false) :
+            SRecord(eRcdDrawLines), count(n), m_X(x), m_Y(y),
+            m_YFlip(yFlip), m_Close(close) {
             iFlags = penId;
-            count = n + (close?1:0);
-            for (int i = 0;  i < n;  ++i) {
-                points[i].x = x[i];
-                points[i].y = y[i];
-            }
-            if (close) {
-                points[n].x = x[0];
-                points[n].y = y[0];
-            }
         }
-        ~SDrawLines(void) { delete[] points; }
         std::string& Serialize(std::string &o) const {
-            SRecord::Serialize(o) << TUInt4(count);
-            for (unsigned int i = 0;  i < count;  ++i) {
-                o << points[i];
-            }
+            SRecord::Serialize(o) << TUInt4(count + (m_Close ? 1 : 0));
+            EMF::AppendPointsFloat4(o, count, m_X, m_Y, m_YFlip, m_Close);
             return o;
 	}
     };
@@ -866,26 +1019,39 @@ namespace EMFPLUS {
 
     struct SImage : SObject {
         unsigned int m_W, m_H;
-        std::string m_RawARGB;
-        SImage(unsigned int *data, unsigned int w, unsigned int h) :
+        const unsigned int *m_Pixels; //R's raster (not copied)
+        SImage(const unsigned int *data, unsigned int w, unsigned int h) :
         SObject(eTypeImage) {
             m_W = w;
             m_H = h;
-            m_RawARGB.resize(w*h*4);
-            for (unsigned int i = 0;  i < m_W*m_H; ++i) {
-                m_RawARGB[4*i+0] = R_BLUE(data[i]);
-                m_RawARGB[4*i+1] = R_GREEN(data[i]);
-                m_RawARGB[4*i+2] = R_RED(data[i]);
-                m_RawARGB[4*i+3] = R_ALPHA(data[i]);
-            }
+            m_Pixels = data;
+        }
+        //fingerprint the pixels themselves (cheaper than encoding them)
+        SObjectKey GetKey(std::string &buff) const {
+            buff.clear();
+            EMF::SFingerprint print;
+            print.AddWords(&m_W, 1);
+            print.AddWords(&m_H, 1);
+            print.AddWords(m_Pixels, (size_t)m_W*m_H);
+            return SObjectKey(type, (size_t)m_W*m_H, print);
         }
         std::string& Serialize(std::string &o) const {
+            std::string png;
+            if (PNG::Encode(m_Pixels, m_W, m_H, png)  &&
+                png.size() < (size_t)m_W*m_H*4) {
+                //compressed bitmap: no stride/format
+                SObject::Serialize(o) << kVersion << TUInt4(1) <<
+                    TUInt4(m_W) << TUInt4(m_H) << TUInt4(0) << TUInt4(0) <<
+                    TUInt4(1);
+                o.append(png);
+                return o;
+            }
             SObject::Serialize(o) << kVersion << TUInt4(1) <<
                 TUInt4(m_W) << TUInt4(m_H) << TUInt4(4*m_W) <<
                 TUInt4(0x26200A) <<
                 //TUInt4(32 << 16 | 10 << 24) << 
                 TUInt4(0);
-            o.append(m_RawARGB);
+            EMF::AppendBGRA(o, m_Pixels, (size_t)m_W*m_H);
             return o;
 	}
     };
@@ -936,154 +1102,422 @@ namespace EMFPLUS {
         pen.miterLimit = lmitre;
     }
 
-    struct ObjectPtrCmp {
-        bool operator() (const SObject* o1, const SObject* o2) const {
-            if (o1->type < o2->type) {
-                return true;
-            } else if (o1->type > o2->type) {
-                return false;
-            } else { //same type -- so compare details
-                switch (o1->type) {
-                case eTypeBrush:
-                    return *dynamic_cast<const SBrush*>(o1) <
-                        *dynamic_cast<const SBrush*>(o2);
-                case eTypePen: {
-                    const SPen *p1 = dynamic_cast<const SPen*>(o1);
-                    const SPen *p2 = dynamic_cast<const SPen*>(o2);
-                    int cmp = memcmp(&p1->pen, &p2->pen, 28);//not ideal..
-                    if (cmp == 0) {
-                        if (p1->pen.dashedLineData < p2->pen.dashedLineData)
-                            return true;
-                        else if (p1->pen.dashedLineData >
-                                 p2->pen.dashedLineData)
-                            return false;
-                    }
+    // ------------------------------------------------------------------------
+    // Replacement policies for the object table.  Once all slots are
+    // full, the policy chooses which slot to recycle for a new object.
+    // Slots used by the drawing operation in progress must never be
+    // chosen (so the most recently used few slots are off limits).
+
+    enum ESlotPolicy {
+        eSlotPolicyLRU,  //least recently used
+        eSlotPolicyCost, //least (uses x bytes to re-emit), with ageing
+        eSlotPolicyPlanned //next used furthest ahead (see CPlannedPolicy)
+    };
 
-                    return (cmp < 0  ||
-                            (cmp == 0  &&
-                             memcmp(&p1->brush, &p2->brush,
-                                    sizeof(p1->brush)) < 0));
+    class CSlotPolicy {
+    public:
+        virtual ~CSlotPolicy(void) {}
+        //object (key) in slot was just used; hits counts uses
+        //(including earlier residencies) and bytes is the size of its
+        //record
+        virtual void Used(unsigned int slot, const SObjectKey &key,
+                          unsigned int hits, unsigned int bytes) = 0;
+        //choose (full) slot to recycle
+        virtual unsigned int Victim(void) = 0;
+        //the objects about to be used, in order (if known)
+        virtual void Plan(const std::vector<SObjectKey> &) {}
+        //the (filled) slots below n, least recently used first
+        virtual void ByRecency(unsigned int n,
+                               std::vector<unsigned int> &slots) const = 0;
+    protected:
+        static void x_ByLastUse(const unsigned long *lastUse, unsigned int n,
+                                std::vector<unsigned int> &slots) {
+            slots.clear();
+            for (unsigned int slot = 0;  slot < n;  ++slot) {
+                unsigned int i = slots.size();
+                slots.push_back(slot);
+                for (;  i > 0  &&  lastUse[slots[i-1]] > lastUse[slot];  --i) {
+                    slots[i] = slots[i-1];
                 }
-                case eTypeFont: {
-                    const SFont* f1 = dynamic_cast<const SFont*>(o1);
-                    const SFont* f2 = dynamic_cast<const SFont*>(o2);
-                    return f1->m_emSize < f2->m_emSize  ||
-                        (f1->m_emSize == f2->m_emSize  &&
-                         (f1->m_Style < f2->m_Style  ||
-                          (f1->m_Style == f2->m_Style  &&
-                           f1->m_FamilyUTF16 < f2->m_FamilyUTF16)));
+                slots[i] = slot;
+            }
+        }
+    };
+
+    class CLRUPolicy : public CSlotPolicy {
+    public:
+        CLRUPolicy(void) {
+            memset(m_InQueue, 0, sizeof(m_InQueue));
+        }
+        void Used(unsigned int slot, const SObjectKey&, unsigned int,
+                  unsigned int) {
+            if (m_InQueue[slot]) {
+                if (m_LastUsedIter[slot] == m_LastUsed.begin()) {
+                    return;
+                }
+                m_LastUsed.erase(m_LastUsedIter[slot]);
+            }
+            m_LastUsed.push_front(slot);
+            m_LastUsedIter[slot] = m_LastUsed.begin();
+            m_InQueue[slot] = true;
+        }
+        unsigned int Victim(void) {
+            unsigned int slot = m_LastUsed.back();
+            m_LastUsed.pop_back();
+            m_InQueue[slot] = false;
+            return slot;
+        }
+        void ByRecency(unsigned int n, std::vector<unsigned int> &slots) const {
+            slots.clear();
+            for (unsigned int slot = 0;  slot < n;  ++slot) {
+                if (!m_InQueue[slot]) { //(not used since recycled)
+                    slots.push_back(slot);
                 }
-                case eTypeStringFormat: {
-                    const SStringFormat* s1 =
-                        dynamic_cast<const SStringFormat*>(o1);
-                    const SStringFormat* s2 =
-                        dynamic_cast<const SStringFormat*>(o2);
-                    return s1->m_Horiz < s2->m_Horiz  ||
-                        (s1->m_Horiz == s2->m_Horiz  &&
-                         s1->m_Vert < s2->m_Vert);
+            }
+            for (TLastUsedQueue::const_reverse_iterator i = m_LastUsed.rbegin();
+                 i != m_LastUsed.rend();  ++i) {
+                if (*i < n) {
+                    slots.push_back(*i);
                 }
-                case eTypePath: {
-                    return *dynamic_cast<const SPath*>(o1) <
-                        *dynamic_cast<const SPath*>(o2);
+            }
+        }
+    private:
+        typedef std::list<unsigned int> TLastUsedQueue;
+        TLastUsedQueue m_LastUsed;
+        TLastUsedQueue::iterator m_LastUsedIter[kMaxObjTableSize];
+        bool m_InQueue[kMaxObjTableSize];
+    };
+
+    //Greedy-dual (size & frequency) policy: a slot's priority is the
+    //cost of having to write its object again (uses x bytes) plus the
+    //priority of the last slot evicted, so that objects which are no
+    //longer used eventually age out however large they are.
+    class CCostPolicy : public CSlotPolicy {
+    public:
+        CCostPolicy(void) : m_Age(0), m_Clock(0) {
+            memset(m_Priority, 0, sizeof(m_Priority));
+            memset(m_LastUse, 0, sizeof(m_LastUse));
+        }
+        void Used(unsigned int slot, const SObjectKey&, unsigned int hits,
+                  unsigned int bytes) {
+            m_Priority[slot] = m_Age + (double) hits * bytes;
+            m_LastUse[slot] = ++m_Clock;
+        }
+        unsigned int Victim(void) {
+            unsigned int victim = kMaxObjTableSize;
+            for (unsigned int i = 0;  i < kMaxObjTableSize;  ++i) {
+                if (m_Clock - m_LastUse[i] < kProtected) {
+                    continue; //possibly part of current drawing operation
                 }
-                case eTypeImage: {
-                    return false; //assume images are unique
+                if (victim == kMaxObjTableSize  ||
+                    m_Priority[i] < m_Priority[victim]) {
+                    victim = i;
                 }
-                default: {//should never happen!
-                    throw std::logic_error("EMF+ object table scrambled");
+            }
+            m_Age = m_Priority[victim];
+            return victim;
+        }
+        void ByRecency(unsigned int n, std::vector<unsigned int> &slots) const {
+            x_ByLastUse(m_LastUse, n, slots);
+        }
+    private:
+        static const unsigned int kProtected = 4;
+        double m_Age;
+        unsigned long m_Clock;
+        double m_Priority[kMaxObjTableSize];
+        unsigned long m_LastUse[kMaxObjTableSize];
+    };
+
+    //Belady's policy: recycle the slot whose object is next used
+    //furthest ahead (or never) in the trace given to Plan, e.g., as
+    //recorded by a dry run of the drawing to come.  Uses that stray
+    //from the trace are matched back up with it where possible.
+    //Objects never used again go least recently used first, so without
+    //a trace (or beyond its end) this is LRU.
+    class CPlannedPolicy : public CSlotPolicy {
+    public:
+        CPlannedPolicy(void) : m_Next(0), m_Clock(0) {
+            memset(m_LastUse, 0, sizeof(m_LastUse));
+        }
+        void Plan(const std::vector<SObjectKey> &trace) {
+            m_Uses.clear();
+            for (unsigned int i = 0;  i < trace.size();  ++i) {
+                m_Uses[trace[i]].push_back(i);
+            }
+            m_Next = 0;
+        }
+        void Used(unsigned int slot, const SObjectKey &key, unsigned int,
+                  unsigned int) {
+            m_Key[slot] = key;
+            m_LastUse[slot] = ++m_Clock;
+            unsigned int use = x_NextUse(key);
+            if (use < m_Next + kMaxSkip) { //(else not in trace)
+                m_Next = use + 1;
+            }
+        }
+        unsigned int Victim(void) {
+            unsigned int victim = kMaxObjTableSize, victimUse = 0;
+            for (unsigned int i = 0;  i < kMaxObjTableSize;  ++i) {
+                if (m_Clock - m_LastUse[i] < kProtected) {
+                    continue; //possibly part of current drawing operation
                 }
+                unsigned int use = x_NextUse(m_Key[i]);
+                if (victim == kMaxObjTableSize  ||  use > victimUse  ||
+                    (use == victimUse  &&
+                     m_LastUse[i] < m_LastUse[victim])) {
+                    victim = i;
+                    victimUse = use;
                 }
             }
+            return victim;
         }
+        void ByRecency(unsigned int n, std::vector<unsigned int> &slots) const {
+            x_ByLastUse(m_LastUse, n, slots);
+        }
+    private:
+        //position in the trace of the next use of key (kNever if none)
+        unsigned int x_NextUse(const SObjectKey &key) const {
+            TUses::const_iterator u = m_Uses.find(key);
+            if (u == m_Uses.end()) {
+                return kNever;
+            }
+            std::vector<unsigned int>::const_iterator i =
+                std::lower_bound(u->second.begin(), u->second.end(), m_Next);
+            return i == u->second.end() ? kNever : *i;
+        }
+        static const unsigned int kProtected = 4;
+        static const unsigned int kMaxSkip = 64; //trace uses missed
+        static const unsigned int kNever = 0xFFFFFFFF;
+        typedef std::map<SObjectKey, std::vector<unsigned int> > TUses;
+        TUses m_Uses; //positions in trace of each object's uses
+        unsigned int m_Next; //position in trace of next use
+        unsigned long m_Clock;
+        SObjectKey m_Key[kMaxObjTableSize];
+        unsigned long m_LastUse[kMaxObjTableSize];
     };
 
+    //the objects some drawing uses, in order, with the size of each
+    //object's record (as recorded by CObjectTable::Trace)
+    struct SObjectTrace {
+        std::vector<SObjectKey> keys;
+        std::map<SObjectKey, unsigned int> bytes;
+        void Clear(void) {
+            keys.clear();
+            bytes.clear();
+        }
+    };
+
+    //counts for comparing replacement policies
+    struct SObjectTableStats {
+        unsigned int nHits;       //object already in table
+        unsigned int nWritten;    //object records written
+        unsigned int nEvictions;  //objects replaced
+        unsigned int nReEmitted;  //written again after eviction
+        double bytesWritten;
+        double bytesReEmitted;
+    };
 
     class CObjectTable {
     public:
-        CObjectTable(void) {
-            memset(m_Table, 0, sizeof(m_Table));
-            for (unsigned int i = 0; i < kMaxObjTableSize; ++i) {
-                m_LastUsed.push_front(i);
-            }
+        CObjectTable(ESlotPolicy policy = eSlotPolicyLRU) : m_NFilled(0) {
+            memset(&m_Stats, 0, sizeof(m_Stats));
+            m_Policy = NULL;
+            m_Trace = NULL;
+            SetPolicy(policy);
         }
         ~CObjectTable(void) {
-            for (unsigned int i = 0;  i < kMaxObjTableSize;  ++i) {
-                delete m_Table[i];
+            delete m_Policy;
+        }
+        //must be called before the table is used
+        void SetPolicy(ESlotPolicy policy) {
+            delete m_Policy;
+            m_Policy = x_NewPolicy(policy);
+        }
+        const SObjectTableStats& GetStats(void) const { return m_Stats; }
+
+        //while trace is non-NULL, objects asked for are only recorded in
+        //it (the table is left unchanged and the ids returned are not
+        //valid), e.g., for a dry run of drawing to be planned
+        void Trace(SObjectTrace *trace) { m_Trace = trace; }
+        //tell the policy which objects are about to be asked for
+        void Plan(const SObjectTrace &trace) { m_Policy->Plan(trace.keys); }
+        //bytes of object records that the given policy would write for
+        //the traced objects, starting from the table as it is now (with
+        //its objects last used in the order the table's policy saw)
+        double Simulate(const SObjectTrace &trace, ESlotPolicy policy) const {
+            CSlotPolicy *sim = x_NewPolicy(policy);
+            SObjectKey table[kMaxObjTableSize];
+            unsigned int hits[kMaxObjTableSize], bytes[kMaxObjTableSize];
+            TIndex index;
+            for (unsigned int slot = 0;  slot < m_NFilled;  ++slot) {
+                table[slot] = m_Table[slot];
+                hits[slot] = m_Hits[slot];
+                bytes[slot] = m_Bytes[slot];
+                index.insert(std::make_pair(table[slot], slot));
             }
+            std::vector<unsigned int> order;
+            m_Policy->ByRecency(m_NFilled, order);
+            for (unsigned int i = 0;  i < order.size();  ++i) {
+                unsigned int slot = order[i];
+                sim->Used(slot, table[slot], hits[slot], bytes[slot]);
+            }
+            sim->Plan(trace.keys);
+            unsigned int nFilled = m_NFilled;
+            double written = 0;
+            for (unsigned int i = 0;  i < trace.keys.size();  ++i) {
+                const SObjectKey &key = trace.keys[i];
+                unsigned int slot;
+                TIndex::iterator s = index.find(key);
+                if (s == index.end()) {
+                    if (nFilled < kMaxObjTableSize) {
+                        slot = nFilled++;
+                    } else {
+                        slot = sim->Victim();
+                        index.erase(table[slot]);
+                    }
+                    table[slot] = key;
+                    hits[slot] = 0;
+                    bytes[slot] = trace.bytes.find(key)->second;
+                    index.insert(std::make_pair(key, slot));
+                    written += bytes[slot];
+                } else {
+                    slot = s->second;
+                }
+                sim->Used(slot, key, ++hits[slot], bytes[slot]);
+            }
+            delete sim;
+            return written;
         }
 
         unsigned char GetPen(unsigned int col, double lwd, unsigned int lty,
                              unsigned int lend, unsigned int ljoin,
                              unsigned int lmitre, double ps2dev,
                              bool useUserLty, EMF::ofstream &out) {
-            SPen *pen = new SPen(col, lwd, lty, lend, ljoin, lmitre, ps2dev,
-                                 useUserLty);
+            SPen pen(col, lwd, lty, lend, ljoin, lmitre, ps2dev, useUserLty);
             return x_InsertObject(pen, out);
         }
-        unsigned char GetBrush(SBrush* brush, EMF::ofstream &out) {
+        unsigned char GetBrush(SBrush &brush, EMF::ofstream &out) {
             return x_InsertObject(brush, out);
         }
         unsigned char GetBrush(unsigned int col, EMF::ofstream &out) {
-            SBrush *brush = new SBrush(col);
+            SBrush brush(col);
             return x_InsertObject(brush, out);
         }
         unsigned char GetFont(unsigned char face, double size,
                               const std::string &familyUTF16,
                               EMF::ofstream &out) {
-            SFont *font = new SFont(face, size, familyUTF16);
+            SFont font(face, size, familyUTF16);
             return x_InsertObject(font, out);
         }
         unsigned char GetStringFormat(EStringAlign h, EStringAlign v,
                                       EMF::ofstream &out) {
-            SStringFormat *fmt = new SStringFormat(h, v);
+            SStringFormat fmt(h, v);
             return x_InsertObject(fmt, out);
         }
-        unsigned char GetPath(SPath* path, EMF::ofstream &out) {
+        unsigned char GetPath(SPath &path, EMF::ofstream &out) {
             return x_InsertObject(path, out);
         }
-        unsigned char GetImage(unsigned int *data, int w, int h,
-                              EMF::ofstream &out) {
-            SImage *image = new SImage(data, w, h);
+        unsigned char GetImage(const unsigned int *data, int w, int h,
+                               EMF::ofstream &out) {
+            SImage image(data, w, h);
             return x_InsertObject(image, out);
         }
     private:
-        //note: takes ownership over pointer!
-        unsigned char x_InsertObject(SObject *obj, EMF::ofstream &out) {
+        //only the object's key is kept, so callers can build objects on
+        //the stack (or reuse one) and no allocation is needed per object
+        unsigned char x_InsertObject(SObject &obj, EMF::ofstream &out) {
+            EMF::CScratchBuffer scratch(out);
+            SObjectKey key = obj.GetKey(*scratch);
+            if (m_Trace) {
+                m_Trace->keys.push_back(key);
+                if (m_Trace->bytes.find(key) == m_Trace->bytes.end()) {
+                    std::streampos startPos = out.tellp();
+                    obj.SetObjId(0);
+                    obj.Write(out, *scratch);
+                    m_Trace->bytes[key] = out.tellp() - startPos;
+                }
+                return 0;
+            }
             unsigned int slot;
-            TIndex::iterator i = m_Index.find(obj);
+            TIndex::iterator i = m_Index.find(key);
             if (i == m_Index.end()) {
-                //use slot last used longest ago
-                slot = m_LastUsed.back();
-                m_LastUsed.pop_back();
-                SObject *old = m_Table[slot];
-                if (old) {
-                    m_Index.erase(old);
-                    delete old;
+                unsigned int hits = 1;
+                bool reEmit = false;
+                TGhosts::iterator g = m_Ghosts.find(key);
+                if (g != m_Ghosts.end()) { //seen before (& evicted)
+                    hits += g->second.hits;
+                    reEmit = true;
+                    m_GhostOrder.erase(g->second.order);
+                    m_Ghosts.erase(g);
                 }
-                obj->SetObjId(slot);
-                obj->Write(out);
-                m_Table[slot] = obj;
-                i = m_Index.insert(obj).first;
-                m_LastUsed.push_front(slot);
-                m_LastUsedIter[slot] = m_LastUsed.begin();
-            } else {
-                delete obj;
-                slot = (*i)->GetObjId();
-                //update slot last used if necesary
-                if (m_LastUsedIter[slot] != m_LastUsed.begin()) {
-                    m_LastUsed.erase(m_LastUsedIter[slot]);
-                    m_LastUsed.push_front(slot);
-                    m_LastUsedIter[slot] = m_LastUsed.begin();
+                if (m_NFilled < kMaxObjTableSize) {
+                    slot = m_NFilled++;
+                } else {
+                    slot = m_Policy->Victim();
+                    m_Index.erase(m_Table[slot]);
+                    x_AddGhost(m_Table[slot], m_Hits[slot]);
+                    ++m_Stats.nEvictions;
+                }
+                obj.SetObjId(slot);
+                std::streampos startPos = out.tellp();
+                obj.Write(out, *scratch);
+                unsigned int bytes = out.tellp() - startPos;
+                m_Table[slot] = key;
+                m_Hits[slot] = hits;
+                m_Bytes[slot] = bytes;
+                m_Index.insert(std::make_pair(key, slot));
+                ++m_Stats.nWritten;
+                m_Stats.bytesWritten += bytes;
+                if (reEmit) {
+                    ++m_Stats.nReEmitted;
+                    m_Stats.bytesReEmitted += bytes;
                 }
+            } else {
+                slot = i->second;
+                ++m_Hits[slot];
+                ++m_Stats.nHits;
             }
+            m_Policy->Used(slot, key, m_Hits[slot], m_Bytes[slot]);
             return slot;
         }
+        static CSlotPolicy* x_NewPolicy(ESlotPolicy policy) {
+            switch (policy) {
+            case eSlotPolicyCost: return new CCostPolicy;
+            case eSlotPolicyPlanned: return new CPlannedPolicy;
+            default: return new CLRUPolicy;
+            }
+        }
+        //remember (a bounded number of) evicted objects, so re-emitted
+        //objects are counted and regain their earlier use counts
+        void x_AddGhost(const SObjectKey &key, unsigned int hits) {
+            if (m_GhostOrder.size() >= kMaxGhosts) {
+                m_Ghosts.erase(m_GhostOrder.back());
+                m_GhostOrder.pop_back();
+            }
+            m_GhostOrder.push_front(key);
+            SGhost ghost;
+            ghost.hits = hits;
+            ghost.order = m_GhostOrder.begin();
+            m_Ghosts.insert(std::make_pair(key, ghost));
+        }
     private:
-        SObject* m_Table[kMaxObjTableSize];
-        typedef std::list<unsigned int> TLastUsedQueue;
-        TLastUsedQueue m_LastUsed;
-        TLastUsedQueue::iterator m_LastUsedIter[kMaxObjTableSize];
-        typedef std::set<SObject*, ObjectPtrCmp> TIndex;
+        static const unsigned int kMaxGhosts = 4*kMaxObjTableSize;
+        SObjectKey m_Table[kMaxObjTableSize];
+        unsigned int m_Hits[kMaxObjTableSize];
+        unsigned int m_Bytes[kMaxObjTableSize];
+        unsigned int m_NFilled;
+        CSlotPolicy *m_Policy;
+        SObjectTrace *m_Trace; //(NULL unless tracing)
+        typedef std::map<SObjectKey, unsigned int> TIndex; //key -> slot
         TIndex m_Index;
+        typedef std::list<SObjectKey> TGhostOrder;
+        struct SGhost {
+            unsigned int hits;
+            TGhostOrder::iterator order;
+        };
+        typedef std::map<SObjectKey, SGhost> TGhosts;
+        TGhosts m_Ghosts;
+        TGhostOrder m_GhostOrder;
+        SObjectTableStats m_Stats;
     };
 } //end of EMFPLUS namespace
@@ -28,9 +28,12 @@
 #ifndef EMF__H
 #define EMF__H
 
+#include <algorithm>
 #include <stdexcept>
 #include <string>
 #include <vector>
+#include <deque>
+#include <map>
 #include <math.h>
 
 namespace EMF {
@@ -38,7 +41,113 @@ namespace EMF {
         bool inEMFplus;
         unsigned int nRecords;
         std::streampos emfPlusStartPos;
-        ofstream(void) : std::ofstream() { inEMFplus = false; nRecords = 0;}
+        //record buffers lent out by CScratchBuffer (a stack, since
+        //records can be written while building another)
+        std::deque<std::string> scratch;
+        unsigned int nScratchInUse;
+        //while holdEMF is set, EMF records written inside an EMF+
+        //comment are held back rather than ending it, so that a run of
+        //them costs a single switch to EMF (see SwitchToEMF)
+        bool holdEMF;
+        std::string heldEMF;
+        ofstream(void) : std::ofstream() {
+            inEMFplus = false;
+            nRecords = 0;
+            nScratchInUse = 0;
+            holdEMF = false;
+        }
+    };
+
+    //borrows a buffer from the stream for the life of this object; the
+    //buffers keep their capacity, so steady-state writing of records
+    //does not allocate
+    class CScratchBuffer {
+    public:
+        CScratchBuffer(ofstream &o) : m_Out(o) {
+            if (o.nScratchInUse == o.scratch.size()) {
+                o.scratch.push_back(std::string());
+            }
+            m_Buff = &o.scratch[o.nScratchInUse++];
+            m_Buff->clear();
+        }
+        ~CScratchBuffer(void) {
+            if (m_Buff->capacity() > kMaxKeep) { //(e.g., after a raster)
+                std::string().swap(*m_Buff);
+            }
+            --m_Out.nScratchInUse;
+        }
+        std::string& operator*(void) { return *m_Buff; }
+    private:
+        static const size_t kMaxKeep = 1 << 20;
+        ofstream &m_Out;
+        std::string *m_Buff;
+    };
+
+    //discards what is written but keeps track of the position (and of
+    //the end of what would have been written), so records can still
+    //seek back to patch sizes
+    class CNullBuffer : public std::streambuf {
+    public:
+        CNullBuffer(std::streampos pos) : m_Pos(pos), m_End(pos) {}
+    protected:
+        int_type overflow(int_type c) {
+            x_Advance(1);
+            return traits_type::not_eof(c);
+        }
+        std::streamsize xsputn(const char*, std::streamsize n) {
+            x_Advance(n);
+            return n;
+        }
+        pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                         std::ios_base::openmode) {
+            if (dir == std::ios_base::beg) {
+                m_Pos = off;
+            } else if (dir == std::ios_base::end) {
+                m_Pos = m_End + off;
+            } else {
+                m_Pos += off;
+            }
+            return m_Pos;
+        }
+        pos_type seekpos(pos_type pos, std::ios_base::openmode) {
+            m_Pos = pos;
+            return m_Pos;
+        }
+    private:
+        void x_Advance(std::streamsize n) {
+            m_Pos += n;
+            if (m_End < m_Pos) {
+                m_End = m_Pos;
+            }
+        }
+        pos_type m_Pos, m_End;
+    };
+
+    //while in scope, records written to the stream are discarded, and
+    //afterwards the stream is as it was before (for dry runs)
+    class CDryRun {
+    public:
+        CDryRun(ofstream &o) :
+            m_Out(o), m_Null(o.tellp()), m_InEMFplus(o.inEMFplus),
+            m_NRecords(o.nRecords), m_EMFPlusStartPos(o.emfPlusStartPos),
+            m_HeldEMF(o.heldEMF) {
+            m_File = o.std::ios::rdbuf(&m_Null);
+        }
+        ~CDryRun(void) {
+            m_Out.std::ios::rdbuf(m_File);
+            m_Out.inEMFplus = m_InEMFplus;
+            m_Out.nRecords = m_NRecords;
+            m_Out.emfPlusStartPos = m_EMFPlusStartPos;
+            m_Out.heldEMF.swap(m_HeldEMF);
+        }
+    private:
+        ofstream &m_Out;
+        CNullBuffer m_Null;
+        std::streambuf *m_File;
+        bool m_InEMFplus;
+        unsigned int m_NRecords;
+        std::streampos m_EMFPlusStartPos;
+        std::string m_HeldEMF;
     };
 }
 
@@ -47,12 +156,26 @@ namespace EMFPLUS {
     void GetDC(EMF::ofstream &o);
 }
 
+namespace EMF {
+    //ends the current EMF+ comment (if any) with the EMF+ record that
+    //enables reading of EMF, then writes any EMF records held back
+    void SwitchToEMF(ofstream &o) {
+        if (o.inEMFplus) {
+            EMFPLUS::GetDC(o);
+            o.inEMFplus = false;
+        }
+        o.write(o.heldEMF.data(), o.heldEMF.size());
+        o.heldEMF.clear();
+    }
+}
+
 // structs for EMF
 namespace EMF {
     enum ERecordType {
         eEMR_HEADER = 1,
         eEMR_POLYGON = 3,
         eEMR_POLYLINE = 4,
+        eEMR_POLYPOLYLINE = 7,
         eEMR_SETBRUSHORGEX = 13,
         eEMR_EOF = 14,
         eEMR_SETMAPMODE = 17,
@@ -79,6 +202,7 @@ namespace EMF {
         eEMR_STRETCHDIBITS = 81,
         eEMR_EXTCREATEFONTINDIRECTW = 82,
         eEMR_EXTTEXTOUTW = 84,
+        eEMR_POLYPOLYLINE16 = 90,
         eEMR_EXTCREATEPEN = 95,
         eEMR_last = 255 //placeholder for max value
     };
@@ -210,24 +334,27 @@ namespace EMF {
             *this = v;
         }
         CLEType& operator= (TType v) {
-            //store as little-endian
+            Store(m_Val, v);
+            return *this;
+        }
+        //store as little-endian directly into an output buffer
+        static void Store(char *dst, TType v) {
             unsigned char *ch = reinterpret_cast<unsigned char*>(&v);
             for (unsigned int i = 0;  i < nBytes;  ++i) {
 #ifdef WORDS_BIGENDIAN
-                m_Val[i] = ch[sizeof(TType) - i - 1];
+                dst[i] = ch[sizeof(TType) - i - 1];
 #else
-                m_Val[i] = ch[i];
+                dst[i] = ch[i];
 #endif
             }
             //make sure we get signed bit if sizeof(TType) > nBytes
             if (sizeof(TType) > nBytes) {
 #ifdef WORDS_BIGENDIAN
-                m_Val[nBytes-1] |= ch[0] & 0x80;
+                dst[nBytes-1] |= ch[0] & 0x80;
 #else
-                m_Val[nBytes-1] |= ch[sizeof(TType) - 1] & 0x80;
+                dst[nBytes-1] |= ch[sizeof(TType) - 1] & 0x80;
 #endif
             }
-            return *this;
         }
 
         bool operator< (const CLEType &other) const {
@@ -243,8 +370,325 @@ namespace EMF {
     typedef CLEType<unsigned short, 2> TUInt2;
     typedef CLEType<unsigned char,  1> TUInt1;
     typedef CLEType<int, 4>   TInt4;
+    typedef CLEType<short, 2> TInt2;
     typedef CLEType<float, 4> TFloat4;
 
+    // ------------------------------------------------------------------------
+    // Point-array kernels.  These read R's coordinate arrays directly,
+    // flip y (EMF has origin in upper left; R in lower left), convert
+    // and write little-endian output in a single pass -- without
+    // modifying the caller's arrays or making intermediate copies.
+
+    //appends n points as pairs of rounded TInt4 and returns bounds
+    inline void AppendPointsInt4(std::string &o, unsigned int n,
+                                 const double *x, const double *y,
+                                 double yFlip, int bounds[4]) {
+        size_t start = o.size();
+        o.resize(start + 8*(size_t)n);
+        char *dst = &o[start];
+        int l = 0, t = 0, r = 0, b = 0;
+        for (unsigned int i = 0;  i < n;  ++i, dst += 8) {
+            int px = (int) floor(x[i] + 0.5);
+            int py = (int) floor(yFlip - y[i] + 0.5);
+            if (i == 0) {
+                l = r = px; t = b = py;
+            } else {
+                l = px < l ? px : l;
+                r = px > r ? px : r;
+                t = py < t ? py : t;
+                b = py > b ? py : b;
+            }
+            TInt4::Store(dst, px);
+            TInt4::Store(dst+4, py);
+        }
+        bounds[0] = l; bounds[1] = t; bounds[2] = r; bounds[3] = b;
+    }
+
+    //appends n points as pairs of rounded TInt2 (caller must check
+    //they fit) and returns bounds
+    inline void AppendPointsInt2(std::string &o, unsigned int n,
+                                 const double *x, const double *y,
+                                 double yFlip, int bounds[4]) {
+        size_t start = o.size();
+        o.resize(start + 4*(size_t)n);
+        char *dst = &o[start];
+        int l = 0, t = 0, r = 0, b = 0;
+        for (unsigned int i = 0;  i < n;  ++i, dst += 4) {
+            int px = (int) floor(x[i] + 0.5);
+            int py = (int) floor(yFlip - y[i] + 0.5);
+            if (i == 0) {
+                l = r = px; t = b = py;
+            } else {
+                l = px < l ? px : l;
+                r = px > r ? px : r;
+                t = py < t ? py : t;
+                b = py > b ? py : b;
+            }
+            TInt2::Store(dst, (short) px);
+            TInt2::Store(dst+2, (short) py);
+        }
+        bounds[0] = l; bounds[1] = t; bounds[2] = r; bounds[3] = b;
+    }
+
+    //appends n points as pairs of TFloat4 (optionally closing the
+    //figure by repeating the first point)
+    inline void AppendPointsFloat4(std::string &o, unsigned int n,
+                                   const double *x, const double *y,
+                                   double yFlip, bool close = false) {
+        size_t start = o.size();
+        o.resize(start + 8*((size_t)n + (close  &&  n > 0 ? 1 : 0)));
+        char *dst = &o[start];
+        for (unsigned int i = 0;  i < n;  ++i, dst += 8) {
+            TFloat4::Store(dst, (float) x[i]);
+            TFloat4::Store(dst+4, (float) (yFlip - y[i]));
+        }
+        if (close  &&  n > 0) {
+            TFloat4::Store(dst, (float) x[0]);
+            TFloat4::Store(dst+4, (float) (yFlip - y[0]));
+        }
+    }
+
+    // ------------------------------------------------------------------------
+    // Pixel kernels.  These read R's raster (one ABGR word per pixel,
+    // red in the low byte) and write DIB pixels straight into the
+    // output buffer, so the pixels are never copied into (or held in)
+    // an intermediate buffer.
+
+    //swap red & blue: ABGR word -> BGRA bytes once stored little-endian
+    inline unsigned int SwizzleBGRA(unsigned int c) {
+        return (c & 0xFF00FF00u) | ((c & 0xFFu) << 16) | ((c >> 16) & 0xFFu);
+    }
+
+    //appends n pixels as 32-bit BGRA
+    inline void AppendBGRA(std::string &o, const unsigned int *data,
+                           size_t n) {
+        size_t start = o.size();
+        o.resize(start + 4*n);
+        char *dst = &o[start];
+        for (size_t i = 0;  i < n;  ++i, dst += 4) {
+            TUInt4::Store(dst, SwizzleBGRA(data[i]));
+        }
+    }
+
+    //appends w x h pixels as 24-bit BGR, with rows padded to 4 bytes
+    inline void AppendBGR(std::string &o, const unsigned int *data,
+                          unsigned int w, unsigned int h) {
+        size_t stride = ((size_t)w*3 + 3) & ~(size_t)3;
+        size_t start = o.size();
+        o.resize(start + stride*h, '\0');
+        for (unsigned int y = 0;  y < h;  ++y) {
+            unsigned char *dst =
+                reinterpret_cast<unsigned char*>(&o[start + y*stride]);
+            const unsigned int *src = data + (size_t)y*w;
+            for (unsigned int x = 0;  x < w;  ++x, dst += 3) {
+                dst[0] = R_BLUE(src[x]);
+                dst[1] = R_GREEN(src[x]);
+                dst[2] = R_RED(src[x]);
+            }
+        }
+    }
+
+    //resamples a w x h raster down to dstW x dstH (each no larger):
+    //averaging (alpha-weighted) over each destination pixel's box if
+    //'box', otherwise taking the nearest source pixel.  Cost is
+    //proportional to source pixels; extra memory to one output row.
+    inline void DownsampleRaster(const unsigned int *data,
+                                 unsigned int w, unsigned int h,
+                                 unsigned int dstW, unsigned int dstH,
+                                 bool box, std::vector<unsigned int> &out) {
+        out.resize((size_t)dstW*dstH);
+        if (!box) {
+            std::vector<unsigned int> srcX(dstW);
+            for (unsigned int i = 0;  i < dstW;  ++i) {
+                srcX[i] = (unsigned int) (((double)i + 0.5)*w/dstW);
+            }
+            for (unsigned int j = 0;  j < dstH;  ++j) {
+                const unsigned int *src = data +
+                    (size_t)(((double)j + 0.5)*h/dstH)*w;
+                for (unsigned int i = 0;  i < dstW;  ++i) {
+                    out[(size_t)j*dstW + i] = src[srcX[i]];
+                }
+            }
+            return;
+        }
+        //each destination row sums the premultiplied channel means
+        //(r,g,b,a) of the source rows it covers, one source row at a
+        //time, so only one row of accumulators is needed
+        std::vector<float> sums((size_t)dstW*4);
+        for (unsigned int j = 0;  j < dstH;  ++j) {
+            unsigned int y0 = (size_t)j*h/dstH;
+            unsigned int y1 = (size_t)(j+1)*h/dstH;
+            std::fill(sums.begin(), sums.end(), 0.f);
+            for (unsigned int y = y0;  y < y1;  ++y) {
+                const unsigned int *src = data + (size_t)y*w;
+                float *dst = &sums[0];
+                for (unsigned int i = 0;  i < dstW;  ++i, dst += 4) {
+                    unsigned int x0 = (size_t)i*w/dstW;
+                    unsigned int x1 = (size_t)(i+1)*w/dstW;
+                    float sum[4] = {0, 0, 0, 0};
+                    for (unsigned int x = x0;  x < x1;  ++x) {
+                        float a = R_ALPHA(src[x]);
+                        sum[0] += a*R_RED(src[x]);
+                        sum[1] += a*R_GREEN(src[x]);
+                        sum[2] += a*R_BLUE(src[x]);
+                        sum[3] += a;
+                    }
+                    for (unsigned int c = 0;  c < 4;  ++c) {
+                        dst[c] += sum[c]/(x1 - x0);
+                    }
+                }
+            }
+            //back to (non-premultiplied) R colours
+            const float *sum = &sums[0];
+            for (unsigned int i = 0;  i < dstW;  ++i, sum += 4) {
+                unsigned int col = 0;
+                if (sum[3] > 0) {
+                    col = R_RGBA((unsigned int) (sum[0]/sum[3] + 0.5f),
+                                 (unsigned int) (sum[1]/sum[3] + 0.5f),
+                                 (unsigned int) (sum[2]/sum[3] + 0.5f),
+                                 (unsigned int) (sum[3]/(y1-y0) + 0.5f));
+                }
+                out[(size_t)j*dstW + i] = col;
+            }
+        }
+    }
+
+    //incremental 128-bit fingerprint (MurmurHash3, x86_128 variant, so
+    //only 32-bit arithmetic is needed), used to recognise repeated
+    //content without keeping it
+    struct SFingerprint {
+        SFingerprint(void) : m_Len(0), m_NTail(0) {
+            m_H[0] = m_H[1] = m_H[2] = m_H[3] = 0; //(seed)
+        }
+        void AddWords(const unsigned int *data, size_t n) {
+            AddBytes(reinterpret_cast<const char*>(data), 4*n);
+        }
+        void AddBytes(const char *data, size_t n) {
+            const unsigned char *p =
+                reinterpret_cast<const unsigned char*>(data);
+            m_Len += n;
+            if (m_NTail > 0) { //complete block started by last call
+                size_t fill = std::min(n, (size_t) (16 - m_NTail));
+                memcpy(m_Tail + m_NTail, p, fill);
+                m_NTail += fill;
+                p += fill;
+                n -= fill;
+                if (m_NTail < 16) {
+                    return;
+                }
+                x_Block(m_Tail);
+                m_NTail = 0;
+            }
+            for (;  n >= 16;  p += 16, n -= 16) {
+                x_Block(p);
+            }
+            memcpy(m_Tail, p, n);
+            m_NTail = n;
+        }
+        //hash of all data added so far
+        void Get(unsigned int print[4]) const {
+            unsigned int h[4], k[4] = {0, 0, 0, 0};
+            memcpy(h, m_H, sizeof(h));
+            for (unsigned int i = 0;  i < m_NTail;  ++i) {
+                k[i/4] |= (unsigned int) m_Tail[i] << (8*(i%4));
+            }
+            //(mixing zero leaves a lane unchanged, so all can be mixed)
+            h[3] ^= x_Rotl(k[3]*0xA1E38B93u, 18)*0x239B961Bu;
+            h[2] ^= x_Rotl(k[2]*0x38B34AE5u, 17)*0xA1E38B93u;
+            h[1] ^= x_Rotl(k[1]*0xAB0E9789u, 16)*0x38B34AE5u;
+            h[0] ^= x_Rotl(k[0]*0x239B961Bu, 15)*0xAB0E9789u;
+            for (unsigned int i = 0;  i < 4;  ++i) {
+                h[i] ^= (unsigned int) m_Len;
+            }
+            h[0] += h[1] + h[2] + h[3];
+            h[1] += h[0]; h[2] += h[0]; h[3] += h[0];
+            for (unsigned int i = 0;  i < 4;  ++i) {
+                h[i] = x_Mix(h[i]);
+            }
+            h[0] += h[1] + h[2] + h[3];
+            h[1] += h[0]; h[2] += h[0]; h[3] += h[0];
+            memcpy(print, h, sizeof(h));
+        }
+    private:
+        static unsigned int x_Rotl(unsigned int x, int r) {
+            return (x << r) | (x >> (32 - r));
+        }
+        static unsigned int x_Mix(unsigned int h) {
+            h ^= h >> 16;
+            h *= 0x85EBCA6Bu;
+            h ^= h >> 13;
+            h *= 0xC2B2AE35u;
+            return h ^ (h >> 16);
+        }
+        void x_Block(const unsigned char *p) {
+            unsigned int k[4];
+            for (unsigned int i = 0;  i < 4;  ++i, p += 4) { //little-endian
+                k[i] = p[0] | (p[1] << 8) | (p[2] << 16) |
+                    ((unsigned int) p[3] << 24);
+            }
+            unsigned int *h = m_H;
+            h[0] ^= x_Rotl(k[0]*0x239B961Bu, 15)*0xAB0E9789u;
+            h[0] = (x_Rotl(h[0], 19) + h[1])*5 + 0x561CCD1Bu;
+            h[1] ^= x_Rotl(k[1]*0xAB0E9789u, 16)*0x38B34AE5u;
+            h[1] = (x_Rotl(h[1], 17) + h[2])*5 + 0x0BCAA747u;
+            h[2] ^= x_Rotl(k[2]*0x38B34AE5u, 17)*0xA1E38B93u;
+            h[2] = (x_Rotl(h[2], 15) + h[3])*5 + 0x96CD1C35u;
+            h[3] ^= x_Rotl(k[3]*0xA1E38B93u, 18)*0x239B961Bu;
+            h[3] = (x_Rotl(h[3], 13) + h[0])*5 + 0x32AC3B17u;
+        }
+        unsigned int m_H[4];
+        size_t m_Len;
+        unsigned char m_Tail[16]; //(part of a block)
+        unsigned int m_NTail;
+    };
+
+    //what an object table retains of an object once written: a type
+    //tag, the size of its data, and either the data itself, for small
+    //objects (pens, brushes, fonts, etc., compared exactly), or a
+    //128-bit fingerprint of it (for paths & images, which can be
+    //large).  Objects with equal keys are serialized identically
+    struct SObjectKey {
+        unsigned int type;
+        unsigned int size; //bytes of object data (pixels, for images)
+        unsigned int print[4]; //fingerprint of larger data (else 0)
+        std::string data; //smaller data (else empty)
+        static const unsigned int kMaxExact = 1024; //bytes kept as is
+        SObjectKey(void) : type(0), size(0) {
+            memset(print, 0, sizeof(print));
+        }
+        SObjectKey(unsigned int t, size_t n, const SFingerprint &fp) :
+            type(t), size(n) {
+            fp.Get(print);
+        }
+        //key of n bytes of data d (kept if small, else fingerprinted)
+        SObjectKey(unsigned int t, const char *d, size_t n) :
+            type(t), size(n) {
+            if (n <= kMaxExact) {
+                memset(print, 0, sizeof(print));
+                data.assign(d, n);
+            } else {
+                SFingerprint fp;
+                fp.AddBytes(d, n);
+                fp.Get(print);
+            }
+        }
+        bool operator< (const SObjectKey &k) const {
+            if (type != k.type) {
+                return type < k.type;
+            }
+            if (size != k.size) {
+                return size < k.size;
+            }
+            int cmp = memcmp(print, k.print, sizeof(print));
+            return cmp != 0 ? cmp < 0 : data < k.data;
+        }
+        bool operator== (const SObjectKey &k) const {
+            return type == k.type  &&  size == k.size  &&
+                memcmp(print, k.print, sizeof(print)) == 0  &&
+                data == k.data;
+        }
+    };
+
     // ------------------------------------------------------------------------
     // EMF Objects used repeatedly
 
@@ -312,16 +756,24 @@ namespace EMF {
             return o << TUInt4(iType) << nSize;
         }
         void Write(EMF::ofstream &o) {
-            if (o.inEMFplus) {
-                EMFPLUS::GetDC(o); // emf+ record to enable reading of emf
-                o.inEMFplus = false;
+            CScratchBuffer scratch(o);
+            Serialize(*scratch);
+            x_Write(o, *scratch);
+        }
+    protected:
+        //writes the record serialized in buff
+        void x_Write(EMF::ofstream &o, std::string &buff) const {
+            if (o.inEMFplus  &&  !o.holdEMF) {
+                SwitchToEMF(o);
             }
             ++o.nRecords;
-            std::string buff; Serialize(buff);
             buff.resize(((buff.size() + 3)/4)*4, '\0'); //add padding
-            std::string finalSize; finalSize << TUInt4(buff.size());
-            buff.replace(4,4, finalSize);
-            o.write(buff.data(), buff.size());
+            TUInt4::Store(&buff[4], buff.size());
+            if (o.inEMFplus) {
+                o.heldEMF.append(buff);
+            } else {
+                o.write(buff.data(), buff.size());
+            }
         }
 };
 
@@ -398,11 +850,25 @@ namespace EMF {
 
     struct SObject : SRecord {
         unsigned int m_ObjId;
-        SObject(ERecordType t) : SRecord(t) {}
+        SObject(ERecordType t) : SRecord(t), m_ObjId(0) {}
         virtual ~SObject(void) {}
         std::string& Serialize(std::string &o) const {
             return SRecord::Serialize(o) << TUInt4(m_ObjId);
         }
+        //keys the serialized fields following the object id, leaving
+        //the serialized object in buff for Write
+        SObjectKey GetKey(std::string &buff) const {
+            buff.clear();
+            Serialize(buff);
+            return SObjectKey(iType, buff.data() + 12, buff.size() - 12);
+        }
+        using SRecord::Write;
+        //writes the object as serialized in buff by GetKey (with the
+        //object id filled in), rather than serializing it again
+        void Write(EMF::ofstream &o, std::string &buff) {
+            TUInt4::Store(&buff[8], m_ObjId);
+            x_Write(o, buff);
+        }
     };
 
     struct SLogPenEx {
@@ -572,28 +1038,66 @@ namespace EMF {
     };
 
     struct SPoly : SRecord { //also == POLYLINE or POLYGON
-        SRect  bounds;
         unsigned int count;
-        SPoint *points;
-        SPoly(ERecordType iType, int n, double *x, double *y) :
-        SRecord(iType), points(new SPoint[n]) {
-            bounds.Set((int) floor(x[0] + 0.5), (int) floor(y[0] + 0.5),
-                       (int) floor(x[0] + 0.5), (int) floor(y[0] + 0.5));
-            count = n;
-            for (int i = 0;  i < n;  ++i) {
-                points[i].Set((int) floor(x[i] + 0.5), (int) floor(y[i] + 0.5));
-                if (points[i].x < bounds.left)   { bounds.left = points[i].x; }
-                if (points[i].x > bounds.right)  { bounds.right = points[i].x; }
-                if (points[i].y > bounds.bottom) { bounds.bottom = points[i].y;}
-                if (points[i].y < bounds.top)    { bounds.top = points[i].y; }
-            }
-        }
-        ~SPoly(void) { delete[] points; }
+        const double *m_X, *m_Y; //not owned; y given in R orientation
+        double m_YFlip;
+        SPoly(ERecordType iType, int n, const double *x, const double *y,
+              double yFlip) :
+            SRecord(iType), count(n), m_X(x), m_Y(y), m_YFlip(yFlip) {}
         std::string& Serialize(std::string &o) const {
-            SRecord::Serialize(o) << bounds << TUInt4(count);
+            SRecord::Serialize(o);
+            size_t boundsPos = o.size();
+            SRect bounds;
+            bounds.Set(0,0,0,0); //placeholder; filled in below
+            o << bounds << TUInt4(count);
+            int b[4];
+            AppendPointsInt4(o, count, m_X, m_Y, m_YFlip, b);
+            bounds.Set(b[0], b[1], b[2], b[3]);
+            std::string boundsLE; boundsLE << bounds;
+            o.replace(boundsPos, boundsLE.size(), boundsLE);
+            return o;
+	}
+    };
+
+    struct SPolyPolyline : SRecord { //POLYPOLYLINE16 if coordinates fit
+        unsigned int nPolys, count;
+        const int *m_NPts; //not owned
+        const double *m_X, *m_Y; //not owned; y given in R orientation
+        double m_YFlip;
+        SPolyPolyline(unsigned int nPoly, const int *nPts,
+                      const double *x, const double *y, double yFlip) :
+            SRecord(eEMR_POLYPOLYLINE16), nPolys(nPoly), count(0),
+            m_NPts(nPts), m_X(x), m_Y(y), m_YFlip(yFlip) {
+            for (unsigned int i = 0;  i < nPolys;  ++i) {
+                count += nPts[i];
+            }
             for (unsigned int i = 0;  i < count;  ++i) {
-                o << points[i];
+                double px = floor(x[i] + 0.5), py = floor(yFlip - y[i] + 0.5);
+                if (px < -32768  ||  px > 32767  ||
+                    py < -32768  ||  py > 32767) {
+                    iType = eEMR_POLYPOLYLINE; //need 32-bit coordinates
+                    break;
+                }
             }
+        }
+        std::string& Serialize(std::string &o) const {
+            SRecord::Serialize(o);
+            size_t boundsPos = o.size();
+            SRect bounds;
+            bounds.Set(0,0,0,0); //placeholder; filled in below
+            o << bounds << TUInt4(nPolys) << TUInt4(count);
+            for (unsigned int i = 0;  i < nPolys;  ++i) {
+                o << TUInt4(m_NPts[i]);
+            }
+            int b[4];
+            if (iType == eEMR_POLYPOLYLINE16) {
+                AppendPointsInt2(o, count, m_X, m_Y, m_YFlip, b);
+            } else {
+                AppendPointsInt4(o, count, m_X, m_Y, m_YFlip, b);
+            }
+            bounds.Set(b[0], b[1], b[2], b[3]);
+            std::string boundsLE; boundsLE << bounds;
+            o.replace(boundsPos, boundsLE.size(), boundsLE);
             return o;
 	}
     };
@@ -773,10 +1277,13 @@ namespace EMF {
         SColorRef bkColorSrc;
         TUInt4 usageSrc;
         int offBmiSrc, cbBmiSrc;
-        int offBitsSrc, cbBitsSrc;
+        int offBitsSrc;
+        size_t cbBitsSrc;
         SBitmapHeader bmpHead;
-        std::string bmpData;
-        S_BITBLT(unsigned int *data, unsigned int srcW, unsigned int srcH,
+        const unsigned int *pixels; //R's raster: not copied, so must
+                                    //outlive the record (until written)
+        size_t nPixels;
+        S_BITBLT(const unsigned int *data, unsigned int srcW, unsigned int srcH,
                  double x, double y, double w, double h) :
             SRecord(eEMR_BITBLT) {
             bounds.Set(x,x+w,y,y+h);
@@ -786,7 +1293,7 @@ namespace EMF {
             offBmiSrc = 25*4;//offset(S_BITBLT,bmp)
             cbBmiSrc = 10*4; //size of bitmap header
             offBitsSrc = offBmiSrc + cbBmiSrc;
-            cbBitsSrc = srcW*srcH*4;//size of bitmap
+            cbBitsSrc = (size_t)srcW*srcH*4;//size of bitmap
             usageSrc = 0; // DIB_RGB_COLORS
             bitBltRasterOp = 0xCC0020; //SRCCOPY
             xformSrc.Set(1,0,0,1,0,0); // identity
@@ -804,13 +1311,8 @@ namespace EMF {
             bmpHead.yPelsPerMeter = 1;
             bmpHead.colorUsed = 0;
             bmpHead.colorImportant = 0;
-            bmpData.resize(srcW*srcH*4);
-            for (unsigned int i = 0;  i < srcW*srcH; ++i) {
-                bmpData[4*i+0] = R_BLUE(data[i]);
-                bmpData[4*i+1] = R_GREEN(data[i]);
-                bmpData[4*i+2] = R_RED(data[i]);
-                bmpData[4*i+3] = R_ALPHA(data[i]);
-            }
+            pixels = data;
+            nPixels = (size_t)srcW*srcH;
         }
 	std::string& Serialize(std::string &o) const {
             SRecord::Serialize(o) << bounds << xDest << yDest <<
@@ -822,7 +1324,7 @@ namespace EMF {
                 bmpHead.imageSize << bmpHead.xPelsPerMeter <<
                 bmpHead.yPelsPerMeter << bmpHead.colorUsed <<
                 bmpHead.colorImportant;
-            o.append(bmpData);
+            AppendBGRA(o, pixels, nPixels);
             return o;
         }
     };
@@ -849,11 +1351,17 @@ namespace EMF {
         SColorRef bkColorSrc; //not in stretchdibits
         TUInt4 usageSrc;
         int offBmiSrc, cbBmiSrc;
-        int offBitsSrc, cbBitsSrc;
+        int offBitsSrc;
+        size_t cbBitsSrc;
         TInt4 cxSrc, cySrc;
         SBitmapHeader bmpHead;
-        std::string bmpData;
-        S_STRETCHBLT(unsigned int *data, unsigned int srcW, unsigned int srcH,
+        std::string colorTable;
+        std::string bmpData; //indexed pixels (if directBits == 0)
+        const unsigned int *pixels; //R's raster: not copied, so must
+                                    //outlive the record (until written)
+        unsigned int directBits; //24 or 32 if written from pixels
+        unsigned int pixW, pixH;
+        S_STRETCHBLT(const unsigned int *data, unsigned int srcW, unsigned int srcH,
                      double x, double y, double w, double h) :
             SRecord(eEMR_STRETCHBLT) {
             bounds.Set(x,x+w,y,y+h);
@@ -862,35 +1370,151 @@ namespace EMF {
             xSrc = ySrc = 0;
             cxSrc = srcW;
             cySrc = srcH;
-            offBmiSrc = 27*4;//offset(S_STRETCHBLT,bmp)
-            cbBmiSrc = 10*4; //size of bitmap header
-            offBitsSrc = offBmiSrc + cbBmiSrc;
-            cbBitsSrc = srcW*srcH*4;//size of bitmap
             usageSrc = 0; // DIB_RGB_COLORS
             bitBltRasterOp = 0xCC0020; //SRCCOPY
             xformSrc.Set(1,0,0,1,0,0); // identity
             bkColorSrc.Set(0,0,0); //src bg color (irrelevant for us)
             cxDest = w;
             cyDest = h;
-            bmpHead.size = cbBmiSrc;
             bmpHead.width = srcW;
             bmpHead.height = -srcH;
             bmpHead.planes = 1;
-            bmpHead.bitCount = 0x20;
             bmpHead.compression = 0;//BI_RGB
             bmpHead.imageSize = 0; //ignored for BI_RGB
             bmpHead.xPelsPerMeter = 1; //arb?
             bmpHead.yPelsPerMeter = 1;
             bmpHead.colorUsed = 0;
             bmpHead.colorImportant = 0;
-            bmpData.resize(srcW*srcH*4);
-            for (unsigned int i = 0;  i < srcW*srcH; ++i) {
-                bmpData[4*i+0] = R_BLUE(data[i]);
-                bmpData[4*i+1] = R_GREEN(data[i]);
-                bmpData[4*i+2] = R_RED(data[i]);
-                bmpData[4*i+3] = R_ALPHA(data[i]);
+            pixels = data;
+            pixW = srcW;
+            pixH = srcH;
+            directBits = 0;
+
+            //single pass to find opacity & colours (up to 257)
+            typedef std::map<unsigned int, unsigned int> TPalette;
+            TPalette palette;
+            bool opaque = true;
+            unsigned int lastCol = data[0] + 1; //differs from first pixel
+            for (size_t i = 0;  i < (size_t)srcW*srcH  &&  opaque;  ++i) {
+                opaque = R_ALPHA(data[i]) == 255;
+                if (data[i] != lastCol  &&  palette.size() <= 256) {
+                    lastCol = data[i];
+                    palette.insert(std::make_pair(lastCol, 0u));
+                }
+            }
+            //(some consumers honour the alpha of 32-bit DIBs, so keep
+            //that format whenever any pixel is not opaque)
+            if (!opaque) {
+                directBits = 32;
+                bmpHead.bitCount = 0x20;
+                cbBitsSrc = (size_t)srcW*srcH*4;
+            } else if (palette.size() > 256) {
+                directBits = 24;
+                bmpHead.bitCount = 24;
+                cbBitsSrc = (((size_t)srcW*3 + 3) & ~(size_t)3)*srcH; //aligned rows
+            } else {
+                x_SetIndexed(data, srcW, srcH, palette);
+                cbBitsSrc = bmpData.size();
+            }
+            bmpHead.size = 10*4; //size of bitmap header
+            offBmiSrc = 27*4;//offset(S_STRETCHBLT,bmp)
+            cbBmiSrc = 10*4 + colorTable.size();
+            offBitsSrc = offBmiSrc + cbBmiSrc;
+        }
+    private:
+        //4- or 8-bit colour table, run-length encoded (BI_RLE8) if
+        //that is smaller
+        void x_SetIndexed(const unsigned int *data, unsigned int w, unsigned int h,
+                          std::map<unsigned int, unsigned int> &palette) {
+            unsigned int nCol = 0;
+            for (std::map<unsigned int, unsigned int>::iterator
+                     i = palette.begin();  i != palette.end();  ++i) {
+                i->second = nCol++;
+                colorTable += (char) R_BLUE(i->first);
+                colorTable += (char) R_GREEN(i->first);
+                colorTable += (char) R_RED(i->first);
+                colorTable += '\0';
+            }
+            bmpHead.colorUsed = nCol;
+            std::vector<unsigned char> index((size_t)w*h);
+            std::map<unsigned int, unsigned int>::iterator last =
+                palette.begin();
+            for (size_t i = 0;  i < (size_t)w*h;  ++i) {
+                if (last->first != data[i]) {
+                    last = palette.find(data[i]);
+                }
+                index[i] = last->second;
+            }
+
+            unsigned int bitCount = nCol <= 16 ? 4 : 8;
+            size_t stride = (((size_t)w*bitCount + 31)/32)*4;
+            std::string rle = x_RLE8(index, w, h);
+            if (rle.size() < stride*h  &&
+                rle.size() < (((size_t)w + 3) & ~(size_t)3)*h) { //& 8-bit
+                bmpHead.bitCount = 8;
+                bmpHead.compression = 1; //BI_RLE8
+                bmpHead.imageSize = rle.size();
+                bmpHead.height = h; //compressed bitmaps must be bottom-up
+                bmpData.swap(rle);
+                return;
+            }
+            bmpHead.bitCount = bitCount;
+            bmpData.assign(stride*h, '\0');
+            for (unsigned int y = 0;  y < h;  ++y) {
+                for (unsigned int x = 0;  x < w;  ++x) {
+                    unsigned char idx = index[(size_t)y*w + x];
+                    if (bitCount == 8) {
+                        bmpData[y*stride + x] = idx;
+                    } else {
+                        bmpData[y*stride + x/2] |= (x % 2) ? idx : idx << 4;
+                    }
+                }
             }
         }
+        static std::string x_RLE8(const std::vector<unsigned char> &index,
+                                  unsigned int w, unsigned int h) {
+            std::string o;
+            for (unsigned int y = h;  y-- > 0;  ) { //bottom-up
+                const unsigned char *row = &index[(size_t)y*w];
+                unsigned int x = 0;
+                while (x < w) {
+                    //encoded run of up to 255 identical pixels
+                    unsigned int run = 1;
+                    while (x + run < w  &&  run < 255  &&
+                           row[x + run] == row[x]) {
+                        ++run;
+                    }
+                    if (run > 1) {
+                        o += (char) run;
+                        o += (char) row[x];
+                        x += run;
+                        continue;
+                    }
+                    //otherwise absolute run up to the next repeat
+                    unsigned int n = 1;
+                    while (x + n < w  &&  n < 255  &&
+                           (x + n + 1 >= w  ||  row[x+n] != row[x+n+1])) {
+                        ++n;
+                    }
+                    if (n < 3) { //absolute mode requires 3 or more
+                        for (unsigned int i = 0;  i < n;  ++i) {
+                            o += (char) 1;
+                            o += (char) row[x+i];
+                        }
+                    } else {
+                        o += '\0';
+                        o += (char) n;
+                        o.append(reinterpret_cast<const char*>(row + x), n);
+                        if (n % 2) o += '\0'; //pad to 16-bit boundary
+                    }
+                    x += n;
+                }
+                o += '\0'; o += '\0'; //end of line
+            }
+            o += '\0'; o += '\1'; //end of bitmap
+            return o;
+        }
+    public:
 	std::string& Serialize(std::string &o) const {
             SRecord::Serialize(o) << bounds << xDest << yDest <<
                 cxDest << cyDest << bitBltRasterOp << xSrc << ySrc <<
@@ -902,41 +1526,15 @@ namespace EMF {
                 bmpHead.imageSize << bmpHead.xPelsPerMeter <<
                 bmpHead.yPelsPerMeter << bmpHead.colorUsed <<
                 bmpHead.colorImportant;
-            o.append(bmpData);
-            return o;
-        }
-    };
-
-    struct ObjectPtrCmp {
-        bool operator() (SObject* o1, SObject* o2) const {
-            if (o1->iType < o2->iType) {
-                return true;
-            } else if (o1->iType > o2->iType) {
-                return false;
-            } else { //same type -- so compare details
-                switch (o1->iType) {
-                case eEMR_EXTCREATEPEN: {
-                    SPen *p1 = dynamic_cast<SPen*>(o1);
-                    SPen *p2 = dynamic_cast<SPen*>(o2);
-                    int res = memcmp(&p1->elp, &p2->elp, sizeof(p1->elp));
-                    if (res != 0) return res < 0;
-                    if (p1->elp.numEntries < p2->elp.numEntries) return true;
-                    if (p1->elp.numEntries > p2->elp.numEntries) return false;
-                    return p1->styleEntries < p2->styleEntries;
-                }
-                case eEMR_CREATEBRUSHINDIRECT:
-                    return memcmp(&dynamic_cast<SBrush*>(o1)->lb,
-                                  &dynamic_cast<SBrush*>(o2)->lb,
-                                  sizeof(dynamic_cast<SBrush*>(o1)->lb)) < 0;
-                case eEMR_EXTCREATEFONTINDIRECTW:
-                    return memcmp(&dynamic_cast<SFont*>(o1)->lf,
-                                  &dynamic_cast<SFont*>(o2)->lf,
-                                  sizeof(dynamic_cast<SFont*>(o1)->lf)) < 0;
-                default: {//should never happen
-                    throw std::logic_error("EMF object table scrambled");
-                }
-                }
+            o.append(colorTable);
+            if (directBits == 32) {
+                AppendBGRA(o, pixels, (size_t)pixW*pixH);
+            } else if (directBits == 24) {
+                AppendBGR(o, pixels, pixW, pixH);
+            } else {
+                o.append(bmpData);
             }
+            return o;
         }
     };
 
@@ -948,20 +1546,13 @@ namespace EMF {
             }
             m_CurrMiterLimit = -1;
         }
-        ~CObjectTable(void) {
-            for (TIndex::iterator i = m_Objects.begin();
-                 i != m_Objects.end();  ++i) {
-                delete *i;
-            }
-        }
         unsigned int GetSize(void) const { return m_Objects.size(); }
 
         unsigned char GetPen(unsigned int col, double lwd, unsigned int lty,
                              unsigned int lend, unsigned int ljoin,
                              unsigned int lmitre, double ps2dev,
                              bool useUserLty, EMF::ofstream &out) {
-            SPen *pen = new SPen(col, lwd, lty, lend, ljoin, ps2dev,
-                                 useUserLty);
+            SPen pen(col, lwd, lty, lend, ljoin, ps2dev, useUserLty);
             if (ljoin == GE_MITRE_JOIN  &&
                 (int) lmitre != m_CurrMiterLimit) {
                 S_SETMITERLIMIT emr;
@@ -969,43 +1560,45 @@ namespace EMF {
                 emr.Write(out);
                 m_CurrMiterLimit = lmitre;
             }
-            return x_SelectObject(pen, out)->m_ObjId;
+            return x_SelectObject(pen, out);
         }
         unsigned char GetBrush(unsigned int col, EMF::ofstream &out) {
-            SBrush *brush = new SBrush(col);
-            return x_SelectObject(brush, out)->m_ObjId;
+            SBrush brush(col);
+            return x_SelectObject(brush, out);
         }
         unsigned char GetFont(unsigned char face, int size,
                               const std::string &familyUTF16,
                               double rot,
                               EMF::ofstream &out) {
-            SFont *font = new SFont(face, size, familyUTF16, rot);
-            return x_SelectObject(font, out)->m_ObjId;
+            SFont font(face, size, familyUTF16, rot);
+            return x_SelectObject(font, out);
         }
     private:
-        SObject* x_GetObject(SObject *obj, EMF::ofstream &out) {
-            TIndex::iterator i = m_Objects.find(obj);
+        //objects are built on the stack and only their keys are kept
+        //(EMF objects are never deleted, so ids are simply sequential)
+        unsigned int x_GetObject(SObject &obj, EMF::ofstream &out) {
+            CScratchBuffer scratch(out);
+            SObjectKey key = obj.GetKey(*scratch);
+            TIndex::iterator i = m_Objects.find(key);
             if (i == m_Objects.end()) {
-                i = m_Objects.insert(obj).first;
-                obj->m_ObjId = m_Objects.size();
-                obj->Write(out);
-            } else {
-                delete obj;
+                obj.m_ObjId = m_Objects.size() + 1;
+                obj.Write(out, *scratch);
+                i = m_Objects.insert(std::make_pair(key, obj.m_ObjId)).first;
             }
-            return (*i);
+            return i->second;
         }
-        SObject* x_SelectObject(SObject *obj, EMF::ofstream &out) {
-            obj = x_GetObject(obj, out);
-            if (m_CurrObj[obj->iType] != (int)obj->m_ObjId) {
+        unsigned char x_SelectObject(SObject &obj, EMF::ofstream &out) {
+            unsigned int id = x_GetObject(obj, out);
+            if (m_CurrObj[obj.iType] != (int)id) {
                 S_SELECTOBJECT emr;
-                emr.ihObject = obj->m_ObjId;
+                emr.ihObject = id;
                 emr.Write(out);
-                m_CurrObj[obj->iType] = obj->m_ObjId;
+                m_CurrObj[obj.iType] = id;
             }
-            return obj;
+            return id;
         }
     private:
-        typedef std::set<SObject*, ObjectPtrCmp> TIndex;        
+        typedef std::map<SObjectKey, unsigned int> TIndex; //key -> id
         TIndex m_Objects;
         int m_CurrObj[eEMR_last];
         int m_CurrMiterLimit;
@@ -0,0 +1,519 @@
+/* $Id$
+    --------------------------------------------------------------------------
+    Add-on package to R to produce EMF graphics output (for import as
+    a high-quality vector graphic into Microsoft Office or OpenOffice).
+
+
+    Copyright (C) 2011 Philip Johnson
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+    Note this header file is C++ (R policy requires that all headers
+    end with .h).
+
+    This header contains device-independent geometry processing applied
+    to R's point arrays before they are turned into EMF/EMF+ records.
+    --------------------------------------------------------------------------
+*/
+
+#ifndef GEOM__H
+#define GEOM__H
+
+#include <cstddef>
+#include <math.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+namespace GEOM {
+
+    // ------------------------------------------------------------------------
+    // Axis-aligned bounding box (used for culling)
+
+    struct SBBox {
+        double x0, y0, x1, y1;
+        SBBox(void) : x0(HUGE_VAL), y0(HUGE_VAL), x1(-HUGE_VAL), y1(-HUGE_VAL) {}
+        SBBox(double xa, double ya, double xb, double yb) :
+            x0(xa < xb ? xa : xb), y0(ya < yb ? ya : yb),
+            x1(xa < xb ? xb : xa), y1(ya < yb ? yb : ya) {}
+        //branch-free min/max loop (vectorizable) over a point array
+        void Extend(unsigned int n, const double *x, const double *y) {
+            double a0 = x0, b0 = y0, a1 = x1, b1 = y1;
+            for (unsigned int i = 0;  i < n;  ++i) {
+                a0 = x[i] < a0 ? x[i] : a0;
+                a1 = x[i] > a1 ? x[i] : a1;
+                b0 = y[i] < b0 ? y[i] : b0;
+                b1 = y[i] > b1 ? y[i] : b1;
+            }
+            x0 = a0; y0 = b0; x1 = a1; y1 = b1;
+        }
+        void Extend(double x, double y) { Extend(1, &x, &y); }
+        void Grow(double d) { x0 -= d; y0 -= d; x1 += d; y1 += d; }
+        bool IsEmpty(void) const { return x0 > x1  ||  y0 > y1; }
+        bool HasZeroArea(void) const { return x0 >= x1  ||  y0 >= y1; }
+        bool Intersects(const SBBox &b) const {
+            return x0 <= b.x1  &&  b.x0 <= x1  &&  y0 <= b.y1  &&  b.y0 <= y1;
+        }
+        bool Contains(const SBBox &b) const {
+            return x0 <= b.x0  &&  b.x1 <= x1  &&  y0 <= b.y0  &&  b.y1 <= y1;
+        }
+        SBBox Intersection(const SBBox &b) const { //(empty if disjoint)
+            SBBox r;
+            r.x0 = x0 > b.x0 ? x0 : b.x0; r.y0 = y0 > b.y0 ? y0 : b.y0;
+            r.x1 = x1 < b.x1 ? x1 : b.x1; r.y1 = y1 < b.y1 ? y1 : b.y1;
+            return r;
+        }
+    };
+
+    // ------------------------------------------------------------------------
+    // Detection of exactly repeated markers.  Redrawing an opaque marker
+    // on top of an identical copy of itself changes nothing, provided
+    // nothing else has been drawn over that area in the meantime.  Each
+    // drawing operation stamps a coarse occupancy grid with a sequence
+    // number; a repeated marker is hidden if no cell under it has been
+    // stamped since its identical twin was drawn.
+
+    class CMarkerDecimator {
+    public:
+        typedef std::vector<double> TKey; //marker style + geometry
+        CMarkerDecimator(void) : m_NX(0), m_NY(0), m_Cell(1), m_Seq(0),
+                                 m_Journal(false), m_Cleared(false),
+                                 m_Checkpoint(0) {}
+        bool IsActive(void) const { return m_NX > 0; }
+        void Init(double width, double height) {
+            double maxDim = width > height ? width : height;
+            m_Cell = maxDim > kMaxCells ? ceil(maxDim / kMaxCells) : 1;
+            m_NX = (unsigned int) ceil(width / m_Cell) + 1;
+            m_NY = (unsigned int) ceil(height / m_Cell) + 1;
+            m_Grid.assign(m_NX*m_NY, 0);
+        }
+        //record drawing over region (for anything other than a marker)
+        void Cover(const SBBox &b) {
+            x_Stamp(b, ++m_Seq);
+        }
+        //returns true if marker would be hidden by (i.e., identical
+        //to) its previous copy; otherwise records marker as drawn
+        bool IsRepeat(const TKey &key, const SBBox &b) {
+            TMarkerMap::iterator i = m_Markers.find(key);
+            if (i != m_Markers.end()  &&  x_MaxStamp(b) == i->second) {
+                return true;
+            }
+            if (m_Markers.size() >= kMaxMarkers) {
+                if (m_Journal  &&  !m_Cleared) { //(restored by Rollback)
+                    m_Cleared = true;
+                    m_MarkersBefore.swap(m_Markers);
+                }
+                m_Markers.clear(); //bound memory (only loses opportunities)
+                i = m_Markers.end();
+            }
+            if (m_Journal  &&  !m_Cleared) {
+                if (i == m_Markers.end()) {
+                    m_MarkerUndo.push_back(std::make_pair(key, 0u));
+                } else if (i->second <= m_Checkpoint) {
+                    m_MarkerUndo.push_back(*i);
+                }
+            }
+            m_Markers[key] = ++m_Seq;
+            x_Stamp(b, m_Seq);
+            return false;
+        }
+        //from now on, records how to undo changes (cheaper than copying
+        //the whole state, e.g., for a dry run of a page)
+        void Checkpoint(void) {
+            m_Journal = true;
+            m_Cleared = false;
+            m_Checkpoint = m_Seq;
+        }
+        //puts back the state as it was at Checkpoint()
+        void Rollback(void) {
+            for (size_t k = m_GridUndo.size();  k > 0;  --k) {
+                m_Grid[m_GridUndo[k-1].first] = m_GridUndo[k-1].second;
+            }
+            if (m_Cleared) {
+                m_Markers.swap(m_MarkersBefore);
+                m_MarkersBefore.clear();
+            }
+            for (size_t k = m_MarkerUndo.size();  k > 0;  --k) {
+                if (m_MarkerUndo[k-1].second == 0) {
+                    m_Markers.erase(m_MarkerUndo[k-1].first);
+                } else {
+                    m_Markers[m_MarkerUndo[k-1].first] =
+                        m_MarkerUndo[k-1].second;
+                }
+            }
+            m_GridUndo.clear();
+            m_MarkerUndo.clear();
+            m_Seq = m_Checkpoint;
+            m_Journal = false;
+        }
+
+    private:
+        typedef std::map<TKey, unsigned int> TMarkerMap;
+        static const unsigned int kMaxCells = 512; //per dimension
+        static const unsigned int kMaxMarkers = 1 << 18;
+
+        void x_Range(const SBBox &b, unsigned int &i0, unsigned int &i1,
+                     unsigned int &j0, unsigned int &j1) const {
+            i0 = x_Index(b.x0, m_NX); i1 = x_Index(b.x1, m_NX);
+            j0 = x_Index(b.y0, m_NY); j1 = x_Index(b.y1, m_NY);
+        }
+        unsigned int x_Index(double v, unsigned int n) const {
+            double i = floor(v / m_Cell);
+            return i < 0 ? 0 : (i >= n ? n-1 : (unsigned int) i);
+        }
+        void x_Stamp(const SBBox &b, unsigned int seq) {
+            unsigned int i0, i1, j0, j1;
+            x_Range(b, i0, i1, j0, j1);
+            for (unsigned int j = j0;  j <= j1;  ++j) {
+                for (unsigned int i = i0;  i <= i1;  ++i) {
+                    unsigned int &cell = m_Grid[j*m_NX + i];
+                    if (m_Journal  &&  cell <= m_Checkpoint) { //(first change)
+                        m_GridUndo.push_back(std::make_pair(j*m_NX + i, cell));
+                    }
+                    cell = seq;
+                }
+            }
+        }
+        unsigned int x_MaxStamp(const SBBox &b) const {
+            unsigned int i0, i1, j0, j1, maxSeq = 0;
+            x_Range(b, i0, i1, j0, j1);
+            for (unsigned int j = j0;  j <= j1;  ++j) {
+                for (unsigned int i = i0;  i <= i1;  ++i) {
+                    maxSeq = std::max(maxSeq, m_Grid[j*m_NX + i]);
+                }
+            }
+            return maxSeq;
+        }
+
+    private:
+        unsigned int m_NX, m_NY;
+        double m_Cell;
+        unsigned int m_Seq;
+        std::vector<unsigned int> m_Grid;
+        TMarkerMap m_Markers;
+
+        //undo journal (see Checkpoint): each grid cell and marker is
+        //logged only the first time it changes, as anything stamped
+        //since has a sequence number after the checkpoint
+        bool m_Journal, m_Cleared;
+        unsigned int m_Checkpoint;
+        std::vector<std::pair<unsigned int, unsigned int> > m_GridUndo;
+        std::vector<std::pair<TKey, unsigned int> > m_MarkerUndo;
+        TMarkerMap m_MarkersBefore; //(if cleared since checkpoint)
+    };
+
+    // ------------------------------------------------------------------------
+    // Error-bounded polyline simplification (Douglas-Peucker).  Retained
+    // points are appended to scratch arrays owned by the simplifier,
+    // which are reused from call to call so steady-state drawing does
+    // not allocate.  Recursion is replaced by an explicit stack.
+
+    class CSimplifier {
+    public:
+        void Clear(void) { m_X.clear(); m_Y.clear(); }
+        const double* X(void) const { return m_X.empty() ? NULL : &m_X[0]; }
+        const double* Y(void) const { return m_Y.empty() ? NULL : &m_Y[0]; }
+        unsigned int Size(void) const { return m_X.size(); }
+
+        //appends simplified version of (x,y) to scratch arrays; every
+        //dropped point lies within 'tol' of the retained outline.
+        //returns number of points appended
+        unsigned int Append(unsigned int n, const double *x, const double *y,
+                            double tol) {
+            if (n <= 2) {
+                m_X.insert(m_X.end(), x, x+n);
+                m_Y.insert(m_Y.end(), y, y+n);
+                return n;
+            }
+            m_Keep.assign(n, 0);
+            m_Keep[0] = m_Keep[n-1] = 1;
+            m_Stack.clear();
+            m_Stack.push_back(0);
+            m_Stack.push_back(n-1);
+            double tol2 = tol*tol;
+            while (!m_Stack.empty()) {
+                unsigned int b = m_Stack.back(); m_Stack.pop_back();
+                unsigned int a = m_Stack.back(); m_Stack.pop_back();
+                double maxD2 = -1;
+                unsigned int maxI = a;
+                for (unsigned int i = a+1;  i < b;  ++i) {
+                    double d2 = x_SegDist2(x[i], y[i], x[a],y[a], x[b],y[b]);
+                    if (d2 > maxD2) {
+                        maxD2 = d2;
+                        maxI = i;
+                    }
+                }
+                if (maxD2 > tol2) {
+                    m_Keep[maxI] = 1;
+                    m_Stack.push_back(a);
+                    m_Stack.push_back(maxI);
+                    m_Stack.push_back(maxI);
+                    m_Stack.push_back(b);
+                }
+            }
+            unsigned int nKept = 0;
+            for (unsigned int i = 0;  i < n;  ++i) {
+                if (m_Keep[i]) {
+                    m_X.push_back(x[i]);
+                    m_Y.push_back(y[i]);
+                    ++nKept;
+                }
+            }
+            return nKept;
+        }
+
+    private:
+        //squared distance from (px,py) to segment (ax,ay)-(bx,by)
+        static double x_SegDist2(double px, double py, double ax, double ay,
+                                 double bx, double by) {
+            double dx = bx - ax, dy = by - ay;
+            double len2 = dx*dx + dy*dy;
+            double t = len2 > 0 ? ((px-ax)*dx + (py-ay)*dy) / len2 : 0;
+            if (t < 0) {
+                t = 0;
+            } else if (t > 1) {
+                t = 1;
+            }
+            double ex = ax + t*dx - px, ey = ay + t*dy - py;
+            return ex*ex + ey*ey;
+        }
+
+    private:
+        std::vector<double> m_X, m_Y;
+        std::vector<unsigned char> m_Keep;
+        std::vector<unsigned int> m_Stack;
+    };
+
+    // ------------------------------------------------------------------------
+    // Least-squares fitting of piecewise cubic Bezier curves to a polyline
+    // (after P.J. Schneider, "An Algorithm for Automatically Fitting
+    // Digitized Curves", Graphics Gems, 1990).  Output is the start
+    // point followed by triples of (control1, control2, end) points.
+    // Points where the polyline turns sharply are kept as corners so
+    // that only smooth runs are replaced by curves.
+
+    class CCurveFitter {
+    public:
+        const double* X(void) const { return m_X.empty() ? NULL : &m_X[0]; }
+        const double* Y(void) const { return m_Y.empty() ? NULL : &m_Y[0]; }
+        unsigned int Size(void) const { return m_X.size(); }
+
+        //returns number of output points (1 + 3*number of curves)
+        unsigned int Fit(unsigned int n, const double *x, const double *y,
+                         double tol) {
+            m_X.clear(); m_Y.clear();
+            //drop repeated points (no tangent direction)
+            m_PX.clear(); m_PY.clear();
+            for (unsigned int i = 0;  i < n;  ++i) {
+                if (i == 0  ||  x[i] != m_PX.back()  ||  y[i] != m_PY.back()) {
+                    m_PX.push_back(x[i]);
+                    m_PY.push_back(y[i]);
+                }
+            }
+            n = m_PX.size();
+            if (n < 2) {
+                return 0;
+            }
+            m_X.push_back(m_PX[0]);
+            m_Y.push_back(m_PY[0]);
+            m_Tol2 = tol*tol;
+            unsigned int first = 0;
+            for (unsigned int i = 1;  i < n;  ++i) {
+                if (i == n-1  ||  x_IsCorner(i)) {
+                    SPt t1 = x_Unit(m_PX[first+1]-m_PX[first],
+                                    m_PY[first+1]-m_PY[first]);
+                    SPt t2 = x_Unit(m_PX[i-1]-m_PX[i], m_PY[i-1]-m_PY[i]);
+                    x_FitRun(first, i, t1, t2);
+                    first = i;
+                }
+            }
+            return m_X.size();
+        }
+
+    private:
+        struct SPt {
+            double x, y;
+            SPt(void) : x(0), y(0) {}
+            SPt(double xx, double yy) : x(xx), y(yy) {}
+        };
+        struct STask {
+            unsigned int first, last;
+            SPt t1, t2;
+        };
+        static SPt x_Unit(double dx, double dy) {
+            double len = sqrt(dx*dx + dy*dy);
+            return len > 0 ? SPt(dx/len, dy/len) : SPt(0, 0);
+        }
+        SPt x_Pt(unsigned int i) const { return SPt(m_PX[i], m_PY[i]); }
+
+        //corners are turns of more than 45 degrees
+        bool x_IsCorner(unsigned int i) const {
+            SPt a = x_Unit(m_PX[i]-m_PX[i-1], m_PY[i]-m_PY[i-1]);
+            SPt b = x_Unit(m_PX[i+1]-m_PX[i], m_PY[i+1]-m_PY[i]);
+            return a.x*b.x + a.y*b.y < 0.7071;
+        }
+
+        static SPt x_Bezier(const SPt *c, double t) {
+            double s = 1-t;
+            double b0 = s*s*s, b1 = 3*t*s*s, b2 = 3*t*t*s, b3 = t*t*t;
+            return SPt(b0*c[0].x + b1*c[1].x + b2*c[2].x + b3*c[3].x,
+                       b0*c[0].y + b1*c[1].y + b2*c[2].y + b3*c[3].y);
+        }
+
+        //fits [first,last] (one corner-free run) using explicit stack
+        void x_FitRun(unsigned int first, unsigned int last, SPt t1, SPt t2) {
+            m_Tasks.clear();
+            STask task = {first, last, t1, t2};
+            m_Tasks.push_back(task);
+            while (!m_Tasks.empty()) {
+                task = m_Tasks.back();
+                m_Tasks.pop_back();
+                SPt c[4];
+                unsigned int split;
+                if (x_FitCubic(task, c, split)) {
+                    m_X.push_back(c[1].x); m_Y.push_back(c[1].y);
+                    m_X.push_back(c[2].x); m_Y.push_back(c[2].y);
+                    m_X.push_back(c[3].x); m_Y.push_back(c[3].y);
+                } else {
+                    SPt tc = x_Unit(m_PX[split-1] - m_PX[split+1],
+                                    m_PY[split-1] - m_PY[split+1]);
+                    STask right = {split, task.last, SPt(-tc.x, -tc.y),
+                                   task.t2};
+                    STask left = {task.first, split, task.t1, tc};
+                    m_Tasks.push_back(right); //LIFO: left processed first
+                    m_Tasks.push_back(left);
+                }
+            }
+        }
+
+        //returns true if fit within tolerance; otherwise sets split
+        bool x_FitCubic(const STask &task, SPt c[4], unsigned int &split) {
+            unsigned int first = task.first, last = task.last;
+            unsigned int nPts = last - first + 1;
+            c[0] = x_Pt(first);
+            c[3] = x_Pt(last);
+            if (nPts == 2) {
+                double dist = sqrt((c[3].x-c[0].x)*(c[3].x-c[0].x) +
+                                   (c[3].y-c[0].y)*(c[3].y-c[0].y)) / 3;
+                c[1] = SPt(c[0].x + task.t1.x*dist, c[0].y + task.t1.y*dist);
+                c[2] = SPt(c[3].x + task.t2.x*dist, c[3].y + task.t2.y*dist);
+                return true;
+            }
+            //chord-length parameterization
+            m_U.resize(nPts);
+            m_U[0] = 0;
+            for (unsigned int i = 1;  i < nPts;  ++i) {
+                double dx = m_PX[first+i] - m_PX[first+i-1];
+                double dy = m_PY[first+i] - m_PY[first+i-1];
+                m_U[i] = m_U[i-1] + sqrt(dx*dx + dy*dy);
+            }
+            for (unsigned int i = 1;  i < nPts;  ++i) {
+                m_U[i] /= m_U[nPts-1];
+            }
+            double maxErr = 0;
+            for (int iter = 0;  iter < 5;  ++iter) {
+                if (iter > 0) { //Newton-Raphson reparameterization
+                    for (unsigned int i = 0;  i < nPts;  ++i) {
+                        m_U[i] = x_NewtonRoot(c, x_Pt(first+i), m_U[i]);
+                    }
+                }
+                x_GenerateBezier(task, c);
+                maxErr = x_MaxError(task, c, split);
+                if (maxErr < m_Tol2) {
+                    return true;
+                } else if (maxErr > 4*m_Tol2) {
+                    break; //reparameterization unlikely to help
+                }
+            }
+            return false;
+        }
+
+        void x_GenerateBezier(const STask &task, SPt c[4]) const {
+            unsigned int first = task.first, last = task.last;
+            double c00 = 0, c01 = 0, c11 = 0, x0 = 0, x1 = 0;
+            for (unsigned int i = 0;  i <= last-first;  ++i) {
+                double t = m_U[i], s = 1-t;
+                double b0 = s*s*s, b1 = 3*t*s*s, b2 = 3*t*t*s, b3 = t*t*t;
+                SPt a0(task.t1.x*b1, task.t1.y*b1);
+                SPt a1(task.t2.x*b2, task.t2.y*b2);
+                c00 += a0.x*a0.x + a0.y*a0.y;
+                c01 += a0.x*a1.x + a0.y*a1.y;
+                c11 += a1.x*a1.x + a1.y*a1.y;
+                double tx = m_PX[first+i] - (c[0].x*(b0+b1) + c[3].x*(b2+b3));
+                double ty = m_PY[first+i] - (c[0].y*(b0+b1) + c[3].y*(b2+b3));
+                x0 += a0.x*tx + a0.y*ty;
+                x1 += a1.x*tx + a1.y*ty;
+            }
+            double det = c00*c11 - c01*c01;
+            double alphaL = det == 0 ? 0 : (x0*c11 - x1*c01) / det;
+            double alphaR = det == 0 ? 0 : (c00*x1 - c01*x0) / det;
+            double segLen = sqrt((c[3].x-c[0].x)*(c[3].x-c[0].x) +
+                                 (c[3].y-c[0].y)*(c[3].y-c[0].y));
+            double eps = 1e-6 * segLen;
+            if (alphaL < eps  ||  alphaR < eps) { //fall back on heuristic
+                alphaL = alphaR = segLen / 3;
+            }
+            c[1] = SPt(c[0].x + task.t1.x*alphaL, c[0].y + task.t1.y*alphaL);
+            c[2] = SPt(c[3].x + task.t2.x*alphaR, c[3].y + task.t2.y*alphaR);
+        }
+
+        //returns maximum squared distance; sets split to worst point
+        double x_MaxError(const STask &task, const SPt c[4],
+                          unsigned int &split) const {
+            unsigned int nPts = task.last - task.first + 1;
+            double maxDist = 0;
+            split = task.first + nPts/2;
+            for (unsigned int i = 1;  i < nPts-1;  ++i) {
+                SPt p = x_Bezier(c, m_U[i]);
+                double dx = p.x - m_PX[task.first+i];
+                double dy = p.y - m_PY[task.first+i];
+                if (dx*dx + dy*dy >= maxDist) {
+                    maxDist = dx*dx + dy*dy;
+                    split = task.first + i;
+                }
+            }
+            return maxDist;
+        }
+
+        static double x_NewtonRoot(const SPt c[4], SPt p, double u) {
+            SPt q = x_Bezier(c, u);
+            SPt d1[3], d2[2]; //control points of 1st & 2nd derivatives
+            for (int i = 0;  i < 3;  ++i) {
+                d1[i] = SPt(3*(c[i+1].x-c[i].x), 3*(c[i+1].y-c[i].y));
+            }
+            for (int i = 0;  i < 2;  ++i) {
+                d2[i] = SPt(2*(d1[i+1].x-d1[i].x), 2*(d1[i+1].y-d1[i].y));
+            }
+            double s = 1-u;
+            SPt q1(s*s*d1[0].x + 2*u*s*d1[1].x + u*u*d1[2].x,
+                   s*s*d1[0].y + 2*u*s*d1[1].y + u*u*d1[2].y);
+            SPt q2(s*d2[0].x + u*d2[1].x, s*d2[0].y + u*d2[1].y);
+            double num = (q.x-p.x)*q1.x + (q.y-p.y)*q1.y;
+            double den = q1.x*q1.x + q1.y*q1.y + (q.x-p.x)*q2.x +
+                (q.y-p.y)*q2.y;
+            return den == 0 ? u : u - num/den;
+        }
+
+    private:
+        double m_Tol2;
+        std::vector<double> m_PX, m_PY; //input without repeated points
+        std::vector<double> m_U;
+        std::vector<STask> m_Tasks;
+        std::vector<double> m_X, m_Y;
+    };
+
+} //end of GEOM namespace
+
+#endif //GEOM__H
@@ -0,0 +1,369 @@
+/* $Id$
+    --------------------------------------------------------------------------
+    Add-on package to R to produce EMF graphics output (for import as
+    a high-quality vector graphic into Microsoft Office or OpenOffice).
+
+
+    Copyright (C) 2011 Philip Johnson
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+    Note this header file is C++ (R policy requires that all headers
+    end with .h).
+
+    This header records the primitives drawn on a page (when output is
+    buffered) as a compact list of operations, independent of the
+    output format, and contains the passes that optimize that list
+    before it is drawn.
+    --------------------------------------------------------------------------
+*/
+
+#ifndef PAGE__H
+#define PAGE__H
+
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "geom.h"
+//(expects the R graphics engine headers to have been included already)
+
+namespace PAGE {
+
+    enum EOpKind {
+        eOpClip, eOpCircle, eOpLine, eOpRect, eOpPolygon, eOpPath, eOpText
+    };
+
+    //one primitive (or change of clip region) as given by R
+    struct SOp {
+        EOpKind kind;
+        unsigned int style; //graphics context (see CPage::Style)
+        unsigned int start, n; //points (rects: opposite corners)
+        unsigned int aux, nAux; //path polygon sizes or text (UTF-8)
+        double p[4]; //clip: x0,x1,y0,y1; circle: radius; text: rot,hadj;
+                     //path: winding
+        GEOM::SBBox ink; //(R coordinates) bounds of all ink drawn
+
+        bool IsDrawing(void) const { return kind != eOpClip; }
+    };
+
+    class CPage {
+    public:
+        void Init(double width, double height) {
+            m_Bounds = GEOM::SBBox(0, 0, width, height);
+        }
+        const GEOM::SBBox& Bounds(void) const { return m_Bounds; }
+        bool IsEmpty(void) const { return m_Ops.empty(); }
+        //true once the page should be drawn to bound memory use
+        bool IsFull(void) const {
+            return m_Ops.size() >= kMaxOps  ||  m_X.size() >= kMaxPts;
+        }
+        void Clear(void) {
+            m_Ops.clear();
+            m_X.clear(); m_Y.clear();
+            m_NPts.clear();
+            m_Text.clear();
+            m_Styles.clear();
+            m_StyleIndex.clear();
+        }
+        void Swap(CPage &page) {
+            std::swap(m_Bounds, page.m_Bounds);
+            m_Ops.swap(page.m_Ops);
+            m_X.swap(page.m_X); m_Y.swap(page.m_Y);
+            m_NPts.swap(page.m_NPts);
+            m_Text.swap(page.m_Text);
+            m_Styles.swap(page.m_Styles);
+            m_StyleIndex.swap(page.m_StyleIndex);
+        }
+
+        void AddClip(double x0, double x1, double y0, double y1) {
+            SOp &op = x_Add(eOpClip, NULL, 0, NULL, NULL, GEOM::SBBox());
+            op.p[0] = x0; op.p[1] = x1; op.p[2] = y0; op.p[3] = y1;
+        }
+        void AddCircle(double x, double y, double r, const pGEcontext gc,
+                       const GEOM::SBBox &ink) {
+            x_Add(eOpCircle, gc, 1, &x, &y, ink).p[0] = r;
+        }
+        //lines, polygons & rects (given by opposite corners)
+        void AddPoly(EOpKind kind, int n, const double *x, const double *y,
+                     const pGEcontext gc, const GEOM::SBBox &ink) {
+            x_Add(kind, gc, n, x, y, ink);
+        }
+        void AddPath(const double *x, const double *y, int nPoly,
+                     const int *nPts, bool winding, const pGEcontext gc,
+                     const GEOM::SBBox &ink) {
+            int n = 0;
+            for (int i = 0;  i < nPoly;  ++i) {
+                n += nPts[i];
+            }
+            SOp &op = x_Add(eOpPath, gc, n, x, y, ink);
+            op.aux = m_NPts.size();
+            op.nAux = nPoly;
+            op.p[0] = winding;
+            m_NPts.insert(m_NPts.end(), nPts, nPts + nPoly);
+        }
+        void AddText(double x, double y, const char *str, double rot,
+                     double hadj, const pGEcontext gc,
+                     const GEOM::SBBox &ink) {
+            SOp &op = x_Add(eOpText, gc, 1, &x, &y, ink);
+            op.aux = m_Text.size();
+            op.nAux = strlen(str);
+            op.p[0] = rot;
+            op.p[1] = hadj;
+            m_Text.append(str, op.nAux + 1); //(with terminator)
+        }
+
+        std::vector<SOp>& Ops(void) { return m_Ops; }
+        const double* X(const SOp &op) const { return &m_X[op.start]; }
+        const double* Y(const SOp &op) const { return &m_Y[op.start]; }
+        const int* NPts(const SOp &op) const { return &m_NPts[op.aux]; }
+        const char* Text(const SOp &op) const { return &m_Text[op.aux]; }
+        pGEcontext Style(const SOp &op) { return &m_Styles[op.style]; }
+
+    private:
+        static const unsigned int kMaxOps = 1 << 20;
+        static const unsigned int kMaxPts = 1 << 22;
+
+        SOp& x_Add(EOpKind kind, const pGEcontext gc, int n,
+                   const double *x, const double *y,
+                   const GEOM::SBBox &ink) {
+            m_Ops.push_back(SOp());
+            SOp &op = m_Ops.back();
+            op.kind = kind;
+            op.style = gc ? x_Style(gc) : 0;
+            op.start = m_X.size();
+            op.n = n;
+            op.aux = op.nAux = 0;
+            op.p[0] = op.p[1] = op.p[2] = op.p[3] = 0;
+            op.ink = ink;
+            m_X.insert(m_X.end(), x, x + n);
+            m_Y.insert(m_Y.end(), y, y + n);
+            return op;
+        }
+        //index of (identical) graphics context, added if new
+        unsigned int x_Style(const pGEcontext gc) {
+            std::string &key = m_StyleKey;
+            key.clear();
+            x_AppendField(key, gc->col);
+            x_AppendField(key, gc->fill);
+            x_AppendField(key, gc->gamma);
+            x_AppendField(key, gc->lwd);
+            x_AppendField(key, gc->lty);
+            x_AppendField(key, gc->lend);
+            x_AppendField(key, gc->ljoin);
+            x_AppendField(key, gc->lmitre);
+            x_AppendField(key, gc->cex);
+            x_AppendField(key, gc->ps);
+            x_AppendField(key, gc->lineheight);
+            x_AppendField(key, gc->fontface);
+            key.append(gc->fontfamily);
+            std::map<std::string, unsigned int>::iterator i =
+                m_StyleIndex.find(key);
+            if (i != m_StyleIndex.end()) {
+                return i->second;
+            }
+            m_Styles.push_back(*gc);
+            m_StyleIndex[key] = m_Styles.size() - 1;
+            return m_Styles.size() - 1;
+        }
+        template<class T> static void x_AppendField(std::string &key,
+                                                    const T &v) {
+            key.append((const char*) &v, sizeof(T));
+        }
+
+        GEOM::SBBox m_Bounds;
+        std::vector<SOp> m_Ops;
+        std::vector<double> m_X, m_Y;
+        std::vector<int> m_NPts;
+        std::string m_Text;
+        std::vector<R_GE_gcontext> m_Styles;
+        std::map<std::string, unsigned int> m_StyleIndex;
+        std::string m_StyleKey; //scratch
+    };
+
+    // ------------------------------------------------------------------------
+    // Passes.  Each changes the page without changing the image drawn
+    // and returns the number of operations removed (or moved).
+
+    //removes operations marked for dropping, keeping order
+    inline unsigned int Remove(std::vector<SOp> &ops,
+                               const std::vector<bool> &drop) {
+        unsigned int nKept = 0;
+        for (unsigned int i = 0;  i < ops.size();  ++i) {
+            if (!drop[i]) {
+                ops[nKept++] = ops[i];
+            }
+        }
+        unsigned int nDropped = ops.size() - nKept;
+        ops.resize(nKept);
+        return nDropped;
+    }
+
+    //visible region (clip region within the page) for each operation
+    inline void VisibleRegions(CPage &page,
+                               std::vector<GEOM::SBBox> &visible) {
+        std::vector<SOp> &ops = page.Ops();
+        visible.resize(ops.size());
+        GEOM::SBBox curr = page.Bounds();
+        for (unsigned int i = 0;  i < ops.size();  ++i) {
+            if (ops[i].kind == eOpClip) {
+                curr = page.Bounds().Intersection
+                    (GEOM::SBBox(ops[i].p[0], ops[i].p[2],
+                                 ops[i].p[1], ops[i].p[3]));
+            }
+            visible[i] = curr;
+        }
+    }
+
+    //drops clip changes superseded before anything is drawn, or that
+    //repeat the clip region already in effect
+    inline unsigned int ElideClips(CPage &page) {
+        std::vector<SOp> &ops = page.Ops();
+        std::vector<bool> drop(ops.size(), false);
+        const SOp *curr = NULL;
+        for (unsigned int i = 0;  i < ops.size();  ++i) {
+            if (ops[i].kind != eOpClip) {
+                continue;
+            }
+            if ((i + 1 < ops.size()  &&  ops[i+1].kind == eOpClip)  ||
+                (curr  &&  memcmp(curr->p, ops[i].p, sizeof(curr->p)) == 0)) {
+                drop[i] = true;
+            } else {
+                curr = &ops[i];
+            }
+        }
+        return Remove(ops, drop);
+    }
+
+    //drops primitives that draw nothing within their clip region, or
+    //whose visible ink is later covered by an opaque filled rectangle
+    inline unsigned int Cull(CPage &page) {
+        static const unsigned int kMaxCovers = 64;
+        std::vector<SOp> &ops = page.Ops();
+        std::vector<GEOM::SBBox> visible;
+        VisibleRegions(page, visible);
+        std::vector<bool> drop(ops.size(), false);
+        std::vector<GEOM::SBBox> covers; //(later rectangles)
+        for (unsigned int i = ops.size();  i-- > 0;  ) {
+            const SOp &op = ops[i];
+            if (!op.IsDrawing()) {
+                continue;
+            }
+            GEOM::SBBox ink = op.ink.Intersection(visible[i]);
+            if (ink.IsEmpty()) {
+                drop[i] = true;
+                continue;
+            }
+            for (unsigned int j = 0;  j < covers.size();  ++j) {
+                if (covers[j].Contains(ink)) {
+                    drop[i] = true;
+                    break;
+                }
+            }
+            if (!drop[i]  &&  op.kind == eOpRect  &&
+                R_OPAQUE(page.Style(op)->fill)  &&
+                covers.size() < kMaxCovers) {
+                const double *x = page.X(op), *y = page.Y(op);
+                GEOM::SBBox cover(x[0], y[0], x[1], y[1]);
+                cover.Grow(-1); //(edges may be anti-aliased)
+                cover = cover.Intersection(visible[i]);
+                if (!cover.HasZeroArea()) {
+                    covers.push_back(cover);
+                }
+            }
+        }
+        return Remove(ops, drop);
+    }
+
+    //drops opaque primitives that exactly repeat an earlier one which
+    //nothing has since been drawn over (see GEOM::CMarkerDecimator)
+    inline unsigned int Dedup(CPage &page) {
+        static const unsigned int kMaxPts = 256; //larger never repeats
+        std::vector<SOp> &ops = page.Ops();
+        std::vector<GEOM::SBBox> visible;
+        VisibleRegions(page, visible);
+        std::vector<bool> drop(ops.size(), false);
+        GEOM::CMarkerDecimator decimator;
+        decimator.Init(page.Bounds().x1, page.Bounds().y1);
+        GEOM::CMarkerDecimator::TKey key;
+        for (unsigned int i = 0;  i < ops.size();  ++i) {
+            const SOp &op = ops[i];
+            if (!op.IsDrawing()) {
+                continue;
+            }
+            pGEcontext gc = page.Style(op);
+            bool opaque = (R_OPAQUE(gc->col)  ||  R_TRANSPARENT(gc->col))  &&
+                (R_OPAQUE(gc->fill)  ||  R_TRANSPARENT(gc->fill));
+            if (!opaque  ||  op.n > kMaxPts) {
+                decimator.Cover(op.ink);
+                continue;
+            }
+            key.clear();
+            key.push_back(op.kind);
+            key.push_back(op.style);
+            key.insert(key.end(), op.p, op.p + 4);
+            key.push_back(visible[i].x0); key.push_back(visible[i].y0);
+            key.push_back(visible[i].x1); key.push_back(visible[i].y1);
+            key.push_back(op.n);
+            key.insert(key.end(), page.X(op), page.X(op) + op.n);
+            key.insert(key.end(), page.Y(op), page.Y(op) + op.n);
+            if (op.kind == eOpPath) {
+                key.insert(key.end(), page.NPts(op), page.NPts(op) + op.nAux);
+            } else if (op.kind == eOpText) {
+                key.insert(key.end(), page.Text(op), page.Text(op) + op.nAux);
+            }
+            drop[i] = decimator.IsRepeat(key, op.ink);
+        }
+        return Remove(ops, drop);
+    }
+
+    //moves primitives of the given kinds (bit mask of 1 << EOpKind)
+    //back to join the latest earlier primitive of the same kind and
+    //style (so they can be drawn together), when within the same clip
+    //region and not overlapping anything drawn in between
+    inline unsigned int Reorder(CPage &page, unsigned int kinds) {
+        static const unsigned int kWindow = 256; //(operations searched)
+        std::vector<SOp> &ops = page.Ops();
+        unsigned int nMoved = 0;
+        for (unsigned int i = 1;  i < ops.size();  ++i) {
+            SOp op = ops[i];
+            if (!op.IsDrawing()  ||  !(kinds & (1 << op.kind))) {
+                continue;
+            }
+            unsigned int stop = i > kWindow ? i - kWindow : 0;
+            int found = -1;
+            for (unsigned int j = i;  j-- > stop;  ) {
+                const SOp &prev = ops[j];
+                if (prev.kind == op.kind  &&  prev.style == op.style) {
+                    found = j;
+                    break;
+                }
+                if (prev.kind == eOpClip  ||  prev.ink.Intersects(op.ink)) {
+                    break;
+                }
+            }
+            if (found >= 0  &&  found + 1 < (int) i) {
+                std::copy_backward(ops.begin() + found + 1, ops.begin() + i,
+                                   ops.begin() + i + 1);
+                ops[found+1] = op;
+                ++nMoved;
+            }
+        }
+        return nMoved;
+    }
+} //end of PAGE namespace
+
+#endif //PAGE__H
@@ -0,0 +1,231 @@
+/* $Id$
+    --------------------------------------------------------------------------
+    Add-on package to R to produce EMF graphics output (for import as
+    a high-quality vector graphic into Microsoft Office or OpenOffice).
+
+
+    Copyright (C) 2011 Philip Johnson
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+    Note this header file is C++ (R policy requires that all headers
+    end with .h).
+
+    This header contains a minimal PNG encoder for R rasters (used for
+    compressed EMF+ bitmaps).  It requires zlib; without it, Encode
+    always fails and callers fall back to uncompressed data.
+    --------------------------------------------------------------------------
+*/
+
+#ifndef PNG__H
+#define PNG__H
+
+#include <stdlib.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace PNG {
+
+#ifdef HAVE_ZLIB
+    //PNG integers are big-endian
+    inline void x_AppendUInt4BE(std::string &o, unsigned int v) {
+        o += (char) ((v >> 24) & 0xFF);
+        o += (char) ((v >> 16) & 0xFF);
+        o += (char) ((v >> 8) & 0xFF);
+        o += (char) (v & 0xFF);
+    }
+
+    inline void x_AppendChunk(std::string &o, const char *type,
+                              const std::string &data) {
+        x_AppendUInt4BE(o, data.size());
+        size_t start = o.size();
+        o.append(type, 4);
+        o.append(data);
+        uLong crc = crc32(0L, Z_NULL, 0);
+        crc = crc32(crc, reinterpret_cast<const Bytef*>(o.data() + start),
+                    o.size() - start);
+        x_AppendUInt4BE(o, crc);
+    }
+
+    inline unsigned char x_Paeth(int a, int b, int c) {
+        int p = a + b - c;
+        int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+        return (pa <= pb  &&  pa <= pc) ? a : (pb <= pc ? b : c);
+    }
+
+    //appends one filtered row (filter byte + data), choosing the
+    //filter with the smallest sum of absolute (signed) residuals
+    inline void x_FilterRow(std::string &o, const unsigned char *row,
+                            const unsigned char *prev, unsigned int nBytes,
+                            unsigned int bpp, std::string &scratch) {
+        scratch.resize(5*nBytes);
+        unsigned long best = 0;
+        unsigned int bestFilter = 0;
+        for (unsigned int f = 0;  f < 5;  ++f) {
+            unsigned char *out = reinterpret_cast<unsigned char*>
+                (&scratch[f*nBytes]);
+            unsigned long sum = 0;
+            for (unsigned int i = 0;  i < nBytes;  ++i) {
+                int a = i >= bpp ? row[i-bpp] : 0;
+                int b = prev ? prev[i] : 0;
+                int c = (i >= bpp  &&  prev) ? prev[i-bpp] : 0;
+                unsigned char pred = 0;
+                switch (f) {
+                case 1: pred = a; break;
+                case 2: pred = b; break;
+                case 3: pred = (a + b) / 2; break;
+                case 4: pred = x_Paeth(a, b, c); break;
+                }
+                out[i] = row[i] - pred;
+                sum += out[i] < 128 ? out[i] : 256 - out[i];
+            }
+            if (f == 0  ||  sum < best) {
+                best = sum;
+                bestFilter = f;
+            }
+        }
+        o += (char) bestFilter;
+        o.append(scratch, bestFilter*nBytes, nBytes);
+    }
+#endif
+
+    //encode R raster (ABGR, as returned by R_RGBA; top row first) as
+    //PNG: palette (1-8 bits) if at most 256 colours, otherwise RGB if
+    //opaque everywhere, otherwise RGBA.  Returns false if unavailable.
+    inline bool Encode(const unsigned int *data, unsigned int w,
+                       unsigned int h, std::string &png) {
+#ifndef HAVE_ZLIB
+        return false;
+#else
+        if (w == 0  ||  h == 0) {
+            return false;
+        }
+        size_t n = (size_t) w * h;
+        //single pass to find colours (up to 257) and opacity
+        std::map<unsigned int, unsigned int> palette;
+        bool opaque = true;
+        unsigned int lastCol = data[0] + 1; //differs from first pixel
+        for (size_t i = 0;  i < n;  ++i) {
+            opaque = opaque  &&  R_ALPHA(data[i]) == 255;
+            if (data[i] != lastCol  &&  palette.size() <= 256) {
+                lastCol = data[i];
+                palette.insert(std::make_pair(lastCol, 0u));
+            }
+        }
+        bool usePalette = palette.size() <= 256;
+
+        unsigned char colorType, bitDepth = 8;
+        unsigned int bpp; //bytes per complete pixel (for filtering)
+        size_t rowBytes;
+        std::string plte, trns;
+        if (usePalette) {
+            //translucent entries first, so tRNS can be short
+            std::vector<unsigned int> cols;
+            for (std::map<unsigned int, unsigned int>::iterator
+                     i = palette.begin();  i != palette.end();  ++i) {
+                if (R_ALPHA(i->first) != 255) cols.push_back(i->first);
+            }
+            size_t nTranslucent = cols.size();
+            for (std::map<unsigned int, unsigned int>::iterator
+                     i = palette.begin();  i != palette.end();  ++i) {
+                if (R_ALPHA(i->first) == 255) cols.push_back(i->first);
+            }
+            for (unsigned int i = 0;  i < cols.size();  ++i) {
+                palette[cols[i]] = i;
+                plte += (char) R_RED(cols[i]);
+                plte += (char) R_GREEN(cols[i]);
+                plte += (char) R_BLUE(cols[i]);
+                if (i < nTranslucent) trns += (char) R_ALPHA(cols[i]);
+            }
+            colorType = 3;
+            bitDepth = cols.size() <= 2 ? 1 : cols.size() <= 4 ? 2 :
+                cols.size() <= 16 ? 4 : 8;
+            bpp = 1;
+            rowBytes = ((size_t) w * bitDepth + 7) / 8;
+        } else {
+            colorType = opaque ? 2 : 6;
+            bpp = opaque ? 3 : 4;
+            rowBytes = (size_t) w * bpp;
+        }
+
+        //build & filter rows
+        std::string filtered, scratch;
+        filtered.reserve(h * (rowBytes + 1));
+        std::vector<unsigned char> row(rowBytes), prev(rowBytes);
+        std::map<unsigned int, unsigned int>::iterator last = palette.end();
+        for (unsigned int y = 0;  y < h;  ++y) {
+            const unsigned int *src = data + (size_t) y * w;
+            if (usePalette) {
+                std::fill(row.begin(), row.end(), 0);
+                for (unsigned int x = 0;  x < w;  ++x) {
+                    if (last == palette.end()  ||  last->first != src[x]) {
+                        last = palette.find(src[x]);
+                    }
+                    unsigned int bit = x * bitDepth;
+                    row[bit/8] |= last->second << (8 - bitDepth - bit%8);
+                }
+                filtered += (char) 0; //no filter (recommended for palettes)
+                filtered.append(reinterpret_cast<const char*>(&row[0]),
+                                rowBytes);
+            } else {
+                unsigned char *dst = &row[0];
+                for (unsigned int x = 0;  x < w;  ++x) {
+                    *dst++ = R_RED(src[x]);
+                    *dst++ = R_GREEN(src[x]);
+                    *dst++ = R_BLUE(src[x]);
+                    if (!opaque) *dst++ = R_ALPHA(src[x]);
+                }
+                x_FilterRow(filtered, &row[0], y > 0 ? &prev[0] : NULL,
+                            rowBytes, bpp, scratch);
+                row.swap(prev);
+            }
+        }
+
+        uLongf zSize = compressBound(filtered.size());
+        std::string idat(zSize, '\0');
+        if (compress2(reinterpret_cast<Bytef*>(&idat[0]), &zSize,
+                      reinterpret_cast<const Bytef*>(filtered.data()),
+                      filtered.size(), Z_DEFAULT_COMPRESSION) != Z_OK) {
+            return false;
+        }
+        idat.resize(zSize);
+
+        png.assign("\x89PNG\r\n\x1a\n", 8);
+        std::string ihdr;
+        x_AppendUInt4BE(ihdr, w);
+        x_AppendUInt4BE(ihdr, h);
+        ihdr += (char) bitDepth;
+        ihdr += (char) colorType;
+        ihdr.append(3, '\0'); //deflate, adaptive filtering, no interlace
+        x_AppendChunk(png, "IHDR", ihdr);
+        if (usePalette) {
+            x_AppendChunk(png, "PLTE", plte);
+            if (!trns.empty()) {
+                x_AppendChunk(png, "tRNS", trns);
+            }
+        }
+        x_AppendChunk(png, "IDAT", idat);
+        x_AppendChunk(png, "IEND", std::string());
+        return true;
+#endif
+    }
+} //end of PNG namespace
+
+#endif //PNG__H
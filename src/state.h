@@ -0,0 +1,231 @@
+/* $Id$
+    --------------------------------------------------------------------------
+    Add-on package to R to produce EMF graphics output (for import as
+    a high-quality vector graphic into Microsoft Office or OpenOffice).
+
+
+    Copyright (C) 2011 Philip Johnson
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+    Note this header file is C++ (R policy requires that all headers
+    end with .h).
+
+    This header tracks the playback state (clip, world transform, text
+    settings, etc.) of the EMF and EMF+ records written so far, so that
+    state records are only written when they change something.
+    --------------------------------------------------------------------------
+*/
+
+#ifndef STATE__H
+#define STATE__H
+
+#include <math.h>
+#include <string.h>
+//(expects emf.h & emf+.h to have been included already)
+
+namespace STATE {
+
+    //affine transform as given to EMF and EMF+ records (row vectors,
+    //so x' = m11*x + m21*y + dx and y' = m12*x + m22*y + dy)
+    struct SXForm {
+        double m11, m12, m21, m22, dx, dy;
+        SXForm(void) : m11(1), m12(0), m21(0), m22(1), dx(0), dy(0) {}
+        SXForm(double a, double b, double c, double d, double e, double f) :
+            m11(a), m12(b), m21(c), m22(d), dx(e), dy(f) {}
+        //rotation (in degrees, as given by R) about the origin, then
+        //translation to (x,y)
+        static SXForm Rotation(double rot, double x, double y) {
+            double c = cos(rot*M_PI/180), s = sin(rot*M_PI/180);
+            return SXForm(c, -s, s, c, x, y);
+        }
+        static SXForm Translation(double x, double y) {
+            return SXForm(1, 0, 0, 1, x, y);
+        }
+        bool IsTranslation(void) const {
+            return m11 == 1  &&  m12 == 0  &&  m21 == 0  &&  m22 == 1;
+        }
+        bool IsIdentity(void) const {
+            return IsTranslation()  &&  dx == 0  &&  dy == 0;
+        }
+        bool operator== (const SXForm &t) const {
+            return m11 == t.m11  &&  m12 == t.m12  &&  m21 == t.m21  &&
+                m22 == t.m22  &&  dx == t.dx  &&  dy == t.dy;
+        }
+        bool operator!= (const SXForm &t) const { return !(*this == t); }
+    };
+
+    //Clip region and world transform are requested ahead of drawing
+    //but only written (by Apply) just before a drawing record that
+    //depends on them, and separately for EMF+ and EMF records (which
+    //have independent playback states).  So clip changes with nothing
+    //drawn in between, or affecting only the other kind of record, cost
+    //nothing.  Other state is written straight away, when changed.
+    class CTracker {
+    public:
+        CTracker(void) {
+            m_HasClip = false;
+            m_Interpolation = -1;
+            m_TextAlign = -1;
+            m_HasTextColor = false;
+            m_PolyFill = -1;
+        }
+
+        void SetClip(double x0, double y0, double x1, double y1) {
+            m_HasClip = true;
+            m_Clip[0] = x0; m_Clip[1] = y0; m_Clip[2] = x1; m_Clip[3] = y1;
+        }
+        void SetTransform(bool plus, const SXForm &xform) {
+            m_Layer[plus].wantXForm = xform;
+        }
+        void ResetTransform(bool plus) {
+            m_Layer[plus].wantXForm = SXForm();
+        }
+        //writes any pending clip & transform changes for EMF+ (plus)
+        //or EMF records; call before writing a drawing record
+        void Apply(bool plus, EMF::ofstream &o) {
+            SLayer &l = m_Layer[plus];
+            bool clipChanged = m_HasClip  &&  (!l.hasClip  ||
+                                              l.clip[0] != m_Clip[0]  ||
+                                              l.clip[1] != m_Clip[1]  ||
+                                              l.clip[2] != m_Clip[2]  ||
+                                              l.clip[3] != m_Clip[3]);
+            if (clipChanged) {
+                //clip rectangles are given in world coordinates
+                if (!l.xform.IsIdentity()) {
+                    x_WriteTransform(plus, SXForm(), o);
+                }
+                if (plus) {
+                    EMFPLUS::SSetClipRect clip(EMFPLUS::eCombineModeReplace,
+                                               m_Clip[0], m_Clip[1],
+                                               m_Clip[2], m_Clip[3]);
+                    clip.Write(o);
+                } else {
+                    EMF::S_EXTSELECTCLIPRGN rgn;//reset to default
+                    rgn.Write(o);
+                    EMF::S_INTERSECTCLIPRECT rect(m_Clip[0], m_Clip[1],
+                                                  m_Clip[2], m_Clip[3]);
+                    rect.Write(o);
+                }
+                l.hasClip = true;
+                memcpy(l.clip, m_Clip, sizeof(m_Clip));
+            }
+            if (l.xform != l.wantXForm) {
+                x_WriteTransform(plus, l.wantXForm, o);
+            }
+        }
+        //EMF+ translation relative to the current transform (e.g., to
+        //advance between glyphs); written straight away
+        void Translate(double dx, double dy, EMF::ofstream &o) {
+            Apply(true, o);
+            EMFPLUS::STranslateWorldTransform trans(dx, dy);
+            trans.Write(o);
+            SXForm &t = m_Layer[true].xform;
+            t.dx += dx*t.m11 + dy*t.m21;
+            t.dy += dx*t.m12 + dy*t.m22;
+            m_Layer[true].wantXForm = t;
+        }
+
+        void SetInterpolation(EMFPLUS::EInterpolationMode mode,
+                              EMF::ofstream &o) {
+            if (m_Interpolation != mode) {
+                EMFPLUS::SSetInterpolationMode emr(mode);
+                emr.Write(o);
+                m_Interpolation = mode;
+            }
+        }
+        void SetTextAlign(unsigned int mode, EMF::ofstream &o) {
+            if (m_TextAlign != (int) mode) {
+                EMF::S_SETTEXTALIGN emr;
+                emr.mode = mode;
+                emr.Write(o);
+                m_TextAlign = mode;
+            }
+        }
+        bool IsTextColor(int col) const {
+            return m_HasTextColor  &&  m_TextColor == col;
+        }
+        //returns true if the colour was changed
+        bool SetTextColor(int col, EMF::ofstream &o) {
+            if (m_HasTextColor  &&  m_TextColor == col) {
+                return false;
+            }
+            EMF::S_SETTEXTCOLOR emr;
+            emr.color.Set(R_RED(col), R_GREEN(col), R_BLUE(col));
+            emr.Write(o);
+            m_TextColor = col;
+            m_HasTextColor = true;
+            return true;
+        }
+        void SetPolyFill(int mode, EMF::ofstream &o) {
+            if (m_PolyFill != mode) {
+                EMF::S_SETPOLYFILLMODE emr;
+                emr.mode = mode;
+                emr.Write(o);
+                m_PolyFill = mode;
+            }
+        }
+
+    private:
+        //writes whichever record(s) take the transform from its
+        //current to the given value in fewest bytes
+        void x_WriteTransform(bool plus, const SXForm &t, EMF::ofstream &o) {
+            SXForm &curr = m_Layer[plus].xform;
+            if (!plus) {
+                EMF::S_SETWORLDTRANSFORM emr;
+                emr.xform.Set(t.m11, t.m12, t.m21, t.m22, t.dx, t.dy);
+                emr.Write(o);
+            } else if (t.IsIdentity()  ||
+                       (t.IsTranslation()  &&  !curr.IsIdentity())) {
+                EMFPLUS::SResetWorldTransform reset;
+                reset.Write(o);
+                if (!t.IsIdentity()) {
+                    EMFPLUS::STranslateWorldTransform trans(t.dx, t.dy);
+                    trans.Write(o);
+                }
+            } else if (t.IsTranslation()) {
+                EMFPLUS::STranslateWorldTransform trans(t.dx, t.dy);
+                trans.Write(o);
+            } else if (curr.IsIdentity()) {
+                EMFPLUS::SMultiplyWorldTransform trans
+                    (t.m11, t.m12, t.m21, t.m22, t.dx, t.dy);
+                trans.Write(o);
+            } else {
+                EMFPLUS::SSetWorldTransform trans
+                    (t.m11, t.m12, t.m21, t.m22, t.dx, t.dy);
+                trans.Write(o);
+            }
+            curr = t;
+        }
+
+        struct SLayer {
+            bool hasClip;
+            double clip[4];
+            SXForm xform; //as written
+            SXForm wantXForm; //as requested
+            SLayer(void) : hasClip(false) {}
+        };
+        SLayer m_Layer[2]; //EMF, EMF+
+        bool m_HasClip;
+        double m_Clip[4]; //as requested
+        int m_Interpolation;
+        int m_TextAlign;
+        bool m_HasTextColor;
+        int m_TextColor; //(any value is a valid R colour)
+        int m_PolyFill;
+    };
+} //end of STATE namespace
+
+#endif //STATE__H